@@ -54,10 +54,54 @@
  * @brief Invalid parameters are passed to a function
  */
 #define MPLITE_ERR_INVPAR    -1
+/**
+ * @brief A pool file cannot be created or mapped, or it is not a pool file
+ *        that was detached cleanly by a build with the same layout
+ */
+#define MPLITE_ERR_FILE      -2
 /**
  * @brief Macro to fix unused parameter compiler warning
  */
 #define MPLITE_UNUSED_PARAM(param)    (void)(param)
+#ifdef MPLITE_64BIT
+/**
+ * @brief Signed integer type of sizes, block indices and offsets. Define
+ *        MPLITE_64BIT to build the 64-bit variant of the library, which
+ *        handles pools and allocations larger than 2 GB. Without it the
+ *        library builds in compact mode, where this is a plain int and the
+ *        API and the @ref mplite_t layout are those of 32-bit pools.
+ */
+typedef int64_t mplite_int_t;
+/**
+ * @brief Unsigned integer type of the byte and block count statistics
+ */
+typedef uint64_t mplite_uint_t;
+/**
+ * @brief Bit mask with one bit per block order
+ */
+typedef uint64_t mplite_mask_t;
+/**
+ * @brief Maximum size of any allocation is ((1 << @ref MPLITE_LOGMAX) *
+ *        mplite_t.szAtom). Since mplite_t.szAtom is always at least 8, it is
+ *        not actually possible to reach this limit.
+ */
+#define MPLITE_LOGMAX 46
+/**
+ * @brief Maximum allocation size of this memory pool library. All allocations
+ *        must be a power of two. The 64-bit variant allows up to 2^46 bytes
+ *        or 64 TB.
+ */
+#define MPLITE_MAX_ALLOC_SIZE    ((mplite_int_t) 1 << 46)
+/**
+ * @brief Maximum number of levels in the free block bitmap of an order. Every
+ *        level summarizes 64 words of the level below it, so eight levels are
+ *        enough to index 2^48 blocks.
+ */
+#define MPLITE_MAPDEPTH 8
+#else
+typedef int mplite_int_t;
+typedef uint32_t mplite_uint_t;
+typedef uint32_t mplite_mask_t;
 /**
  * @brief Maximum size of any allocation is ((1 << @ref MPLITE_LOGMAX) *
  *        mplite_t.szAtom). Since mplite_t.szAtom is always at least 8 and
@@ -71,10 +115,55 @@
  *        integer. Hence the largest allocation is 0x40000000 or 1073741824.
  */
 #define MPLITE_MAX_ALLOC_SIZE    0x40000000
+/**
+ * @brief Maximum number of levels in the free block bitmap of an order. Every
+ *        level summarizes 64 words of the level below it, so six levels are
+ *        enough to index the 2^31 blocks addressable by a signed 32-bit
+ *        integer.
+ */
+#define MPLITE_MAPDEPTH 6
+#endif /* #ifdef MPLITE_64BIT */
 /**
  * @brief An indicator that a function is a public API
  */
 #define MPLITE_API
+/**
+ * @brief Alignment that @ref mplite_init gives the start of the pool, so that
+ *        blocks of at least this size are aligned to it in absolute terms.
+ *        The alignment is halved for buffers too small to spare the padding.
+ */
+#define MPLITE_POOL_ALIGN 4096
+/**
+ * @brief Bytes reserved for the header at the start of a pool file. The pool
+ *        itself follows the header.
+ */
+#define MPLITE_FILE_HEADER 4096
+/**
+ * @brief Assumed size in bytes of a CPU cache line. The statistics of a
+ *        @ref mplite_t object are padded by this much on both sides.
+ */
+#define MPLITE_CACHE_LINE 64
+/**
+ * @brief Number of orders, counted from the smallest, that may be given
+ *        quick lists by @ref mplite_lazy_init
+ */
+#define MPLITE_QUICK_ORDERS 8
+/**
+ * @brief Number of blocks a quick list holds before it is coalesced when
+ *        @ref mplite_lazy_init is given a high-water mark of zero
+ */
+#define MPLITE_QUICK_MAX 64
+/**
+ * @brief Number of blocks waiting on the remote-free queue of a pool that
+ *        makes it due for draining, when @ref mplite_remote_init is given a
+ *        threshold of zero
+ */
+#define MPLITE_REMOTE_MAX 256
+/**
+ * @brief Maximum number of regions that @ref mplite_add_region can add to a
+ *        memory pool object
+ */
+#define MPLITE_REGION_MAX 16
 
 /**
  * @brief Lock object to be used in a threadsafe memory pool
@@ -86,42 +175,372 @@ typedef struct mplite_lock {
     int (*release)(void *arg); /**< Function pointer to release a lock */
 } mplite_lock_t;
 
+/**
+ * @brief Lock argument of @ref mplite_init that selects the built-in
+ *        test-and-test-and-set spinlock with exponential backoff. Built-in
+ *        locks live in the @ref mplite_t object and their uncontended path is
+ *        inlined, without any call through the @ref mplite_lock_t callbacks.
+ */
+#define MPLITE_LOCK_SPIN      ((const mplite_lock_t *) 1)
+/**
+ * @brief Lock argument of @ref mplite_init that selects the built-in
+ *        futex-based mutex. Waiters spin briefly and then sleep in the
+ *        kernel. Where futexes are not available they yield the CPU instead.
+ */
+#define MPLITE_LOCK_FUTEX     ((const mplite_lock_t *) 2)
+/**
+ * @brief Lock argument of @ref mplite_init that selects the built-in ticket
+ *        lock, which serves waiting threads in first come, first served order.
+ *        Best kept to no more threads than CPUs: when the next thread in line
+ *        is preempted, every thread behind it waits as well.
+ */
+#define MPLITE_LOCK_TICKET    ((const mplite_lock_t *) 3)
+
 /**
  * @brief Memory pool object
  */
-typedef struct mplite {
+typedef struct mplite_pool {
     /*-------------------------------
       Memory available for allocation
       -------------------------------*/
-    int szAtom; /**< Smallest possible allocation in bytes */
-    int nBlock; /**< Number of szAtom sized blocks in zPool */
+    mplite_int_t szAtom; /**< Smallest possible allocation in bytes */
+    mplite_int_t nBlock; /**< Number of szAtom sized blocks in zPool */
     uint8_t *zPool; /**< Memory available to be allocated */
 
     mplite_lock_t lock; /**< Lock to control access to the memory allocation
         subsystem. */
+    int lockPolicy; /**< Built-in lock selected by @ref MPLITE_LOCK_SPIN,
+        @ref MPLITE_LOCK_FUTEX or @ref MPLITE_LOCK_TICKET, numbered as their
+        values, or zero to use the lock callbacks */
+    volatile uint32_t aLockWord[2]; /**< State of the built-in lock */
+    void *volatile pRemote; /**< Lock-free stack of the blocks freed by
+        threads other than the owner and not yet given back, linked through
+        their first bytes */
+    volatile uint32_t nRemote; /**< Number of blocks on pRemote, counted
+        before they are pushed */
+    uint32_t nRemoteMax; /**< Value of nRemote at which pRemote is drained by
+        the next free of the owner, or by the freeing thread itself for a
+        pool without an owner. Zero if there is no remote-free queue. */
+    const void *pOwner; /**< Thread set by @ref mplite_remote_init whose
+        frees take the lock. NULL if @ref mplite_set_free decides instead. */
+
+    uint8_t aPadStats[MPLITE_CACHE_LINE]; /**< Keeps the statistics off the
+        cache lines of the fields above */
 
     /*----------------------
       Performance statistics
       ----------------------*/
+    volatile uint32_t nStatSeq; /**< Sequence number of the statistics. It is
+        odd while the lock holder may be updating them, and bumped again when
+        it is done, so that @ref mplite_get_stats can read them without the
+        lock. */
     uint64_t nAlloc; /**< Total number of calls to malloc */
     uint64_t totalAlloc; /**< Total of all malloc calls - includes internal
         fragmentation */
     uint64_t totalExcess; /**< Total internal fragmentation */
-    uint32_t currentOut; /**< Current checkout, including internal
+    mplite_uint_t currentOut; /**< Current checkout, including internal
         fragmentation */
-    uint32_t currentCount; /**< Current number of distinct checkouts */
-    uint32_t maxOut; /**< Maximum instantaneous currentOut */
-    uint32_t maxCount; /**< Maximum instantaneous currentCount */
-    uint32_t maxRequest; /**< Largest allocation (exclusive of internal frag) */
+    mplite_uint_t currentCount; /**< Current number of distinct checkouts */
+    mplite_uint_t maxOut; /**< Maximum instantaneous currentOut */
+    mplite_uint_t maxCount; /**< Maximum instantaneous currentCount */
+    mplite_uint_t maxRequest; /**< Largest allocation (exclusive of internal
+        frag) */
+    uint64_t nFail; /**< Number of allocation requests that failed */
+    uint64_t anAlloc[MPLITE_LOGMAX + 1]; /**< Allocations of each order */
+    uint64_t anFree[MPLITE_LOGMAX + 1]; /**< Frees of each order */
+    uint64_t anSplit[MPLITE_LOGMAX + 1]; /**< Free blocks of each order split
+        in halves to serve a smaller allocation */
+    uint64_t anCoalesce[MPLITE_LOGMAX + 1]; /**< Blocks of each order formed
+        by merging two free buddies */
+    mplite_int_t anFreeBlock[MPLITE_LOGMAX + 1]; /**< Free blocks of each
+        order */
+    uint64_t nLockAcquire; /**< Number of times the lock was taken */
+    uint64_t nLockContended; /**< Number of times a built-in lock had to wait
+        before it was taken. Waits for a lock given as callbacks are not
+        seen by the pool. */
+    uint64_t nLockWaitNs; /**< Total time spent waiting for a built-in lock
+        in nanoseconds */
+
+    uint8_t aPadPool[MPLITE_CACHE_LINE]; /**< Keeps the statistics off the
+        cache lines of the fields below */
 
-    int aiFreelist[MPLITE_LOGMAX + 1]; /**< List of free blocks. aiFreelist[0]
-        is a list of free blocks of size mplite_t.szAtom. aiFreelist[1] holds
-        blocks of size szAtom * 2 and so forth.*/
+    mplite_int_t aiFreelist[MPLITE_LOGMAX + 1]; /**< Lowest-indexed free block of each
+        order or -1 if there is none. aiFreelist[0] is the first free block of
+        size mplite_t.szAtom. aiFreelist[1] is the first free block of size
+        szAtom * 2 and so forth.*/
+    mplite_mask_t mFreeOrders; /**< Bitmap of non-empty aiFreelist[] entries. Bit N
+        is set if and only if aiFreelist[N] holds at least one free block. */
+    int nQuickOrder; /**< Blocks of orders below this one are freed to the
+        quick lists without coalescing. Zero unless set by
+        @ref mplite_lazy_init. */
+    int nQuickMax; /**< Number of blocks a quick list may hold before it is
+        coalesced */
+    mplite_mask_t mQuickOrders; /**< Bitmap of non-empty aiQuick[] entries */
+    mplite_int_t aiQuick[MPLITE_QUICK_ORDERS]; /**< Last block freed to each
+        quick list. The first bytes of each block on a quick list hold the
+        index of the next one. */
+    int anQuick[MPLITE_QUICK_ORDERS]; /**< Number of blocks on each quick
+        list */
+    uint64_t *aMap; /**< Hierarchical bitmaps of the free blocks of every order.
+        Bit (i >> N) of the bottom level of order N is set if block i is a free
+        block of that order. Each bit of an upper level tells whether the
+        corresponding word of the level below has any bit set. */
+    mplite_int_t aMapOff[MPLITE_LOGMAX + 1][MPLITE_MAPDEPTH]; /**< Offset in
+        64-bit words from aMap to each level of each order's bitmap. Level 0 is
+        the bottom level. */
+    int anMapDepth[MPLITE_LOGMAX + 1]; /**< Number of levels in each order's
+        bitmap. Zero for orders larger than the pool itself. */
 
     uint8_t *aCtrl; /**< Space for tracking which blocks are checked out and the
         size of each block.  One byte per block. */
+
+    void *pFile; /**< Mapping of the backing file of a persistent pool or of
+        the segment of a shared pool, or NULL if the pool lives in memory given
+        to @ref mplite_init */
+    struct mplite_trace *pTrace; /**< Trace being recorded by
+        @ref mplite_trace_start, or NULL */
+    struct mplite_pool *apRegion[MPLITE_REGION_MAX]; /**< Regions added by
+        @ref mplite_add_region, in the order they were added. Each one is a
+        memory pool object of its own, kept at the start of its buffer and
+        guarded by the lock of this one. */
+    int nRegion; /**< Number of regions in apRegion */
 } mplite_t;
 
+/**
+ * @brief Number of block orders held by a @ref mplite_tcache_t. Requests up to
+ *        (mplite_t.szAtom << (@ref MPLITE_TCACHE_ORDERS - 1)) bytes are served
+ *        from the cache, larger ones go straight to the pool.
+ */
+#define MPLITE_TCACHE_ORDERS 8
+/**
+ * @brief Number of blocks per order kept by a @ref mplite_tcache_t when
+ *        @ref mplite_tcache_init is given a capacity of zero.
+ */
+#define MPLITE_TCACHE_CAPACITY 32
+
+/**
+ * @brief Per-thread allocation cache in front of a @ref mplite_t object. Each
+ *        small order has a bounded magazine of blocks that is refilled from
+ *        and flushed to the pool in batches, so most calls never take the
+ *        pool lock. A cache must only be used by one thread at a time.
+ *        Blocks held in a magazine are checked out as far as the pool and its
+ *        statistics are concerned.
+ */
+typedef struct mplite_tcache {
+    mplite_t *pool; /**< Pool that the cached blocks belong to */
+    int nCapacity; /**< Maximum number of blocks in each magazine */
+    int nBatch; /**< Number of blocks moved per refill or flush */
+    void *apMagazine[MPLITE_TCACHE_ORDERS]; /**< Singly-linked list of cached
+        blocks of each order. The link is stored in the block itself. */
+    int anMagazine[MPLITE_TCACHE_ORDERS]; /**< Number of blocks in each
+        magazine */
+    uint64_t nHit; /**< Allocations served from a magazine */
+    uint64_t nMiss; /**< Allocations that had to refill a magazine */
+} mplite_tcache_t;
+
+/**
+ * @brief Maximum number of shards in a @ref mplite_set_t
+ */
+#define MPLITE_SET_MAX 64
+/**
+ * @brief Shard affinity of a @ref mplite_set_t: every thread gets a home shard
+ *        of its own, assigned round-robin on its first allocation.
+ */
+#define MPLITE_AFFINITY_THREAD 0
+/**
+ * @brief Shard affinity of a @ref mplite_set_t: the home shard is the one of
+ *        the CPU the calling thread runs on. Falls back to
+ *        @ref MPLITE_AFFINITY_THREAD where the CPU number is not available.
+ */
+#define MPLITE_AFFINITY_CPU 1
+
+/**
+ * @brief Set of independent memory pools that spread contention over several
+ *        locks. Each thread allocates from its home shard first and steals
+ *        from the other shards when its home shard cannot satisfy a request.
+ *        Freed memory always goes back to the shard that owns it.
+ */
+typedef struct mplite_set {
+    mplite_t *apShard[MPLITE_SET_MAX]; /**< Shards sorted by the address of
+        their memory so that the owner of a pointer can be found by a binary
+        search */
+    int nShard; /**< Number of shards in apShard */
+    int affinity; /**< @ref MPLITE_AFFINITY_THREAD or
+        @ref MPLITE_AFFINITY_CPU */
+} mplite_set_t;
+
+/**
+ * @brief Maximum number of size classes of a @ref mplite_slab_t
+ */
+#define MPLITE_SLAB_CLASSES 16
+/**
+ * @brief Size in bytes of the pool blocks carved into slots by a
+ *        @ref mplite_slab_t when @ref mplite_slab_init is given a slab size of
+ *        zero.
+ */
+#define MPLITE_SLAB_SIZE 4096
+
+/**
+ * @brief Slab front-end in front of a @ref mplite_t object for small objects
+ *        whose size is not a power of two. Pool blocks of a fixed size are
+ *        carved into equal slots of one size class each, so a 72-byte object
+ *        takes an 80-byte slot instead of a 128-byte block. A slab goes back
+ *        to the pool as soon as its last slot is freed. Every operation runs
+ *        under the pool lock, so a slab front-end may be shared by as many
+ *        threads as its pool, except on a pool given a remote-free queue and
+ *        no lock, where only the owner may use it.
+ */
+typedef struct mplite_slab {
+    mplite_t *pool; /**< Pool that the slabs are carved out of */
+    mplite_int_t szSlab; /**< Size in bytes of each slab */
+    int iSlabLog; /**< Order of the slab blocks in the pool */
+    int nClass; /**< Number of size classes */
+    int anSize[MPLITE_SLAB_CLASSES]; /**< Slot size of each class in bytes, in
+        ascending order */
+    int anSlot[MPLITE_SLAB_CLASSES]; /**< Number of slots in a slab of each
+        class */
+    int anOffset[MPLITE_SLAB_CLASSES]; /**< Offset in bytes of the first slot
+        from the start of a slab of each class */
+    void *apPartial[MPLITE_SLAB_CLASSES]; /**< List of the slabs of each class
+        with at least one free slot */
+    mplite_uint_t nSlab; /**< Number of slabs taken from the pool */
+    mplite_uint_t currentOut; /**< Bytes in checked out slots */
+    mplite_uint_t currentCount; /**< Number of checked out slots */
+} mplite_slab_t;
+
+/**
+ * @brief Snapshot of the statistics of a @ref mplite_t object, filled in by
+ *        @ref mplite_get_stats. Per-order arrays are indexed by the order of
+ *        the block: order N holds blocks of (szAtom << N) bytes.
+ */
+typedef struct mplite_stats {
+    uint64_t szAtom; /**< Smallest possible allocation in bytes */
+    uint64_t nPoolBytes; /**< Bytes of memory available for allocation */
+    int nOrder; /**< Number of orders the pool can hold. Entries of the
+        per-order arrays from nOrder up are always zero. */
+    uint64_t nAlloc; /**< Total number of successful allocations */
+    uint64_t nFail; /**< Number of allocation requests that failed */
+    uint64_t totalAlloc; /**< Total bytes allocated, including internal
+        fragmentation */
+    uint64_t totalExcess; /**< Total internal fragmentation in bytes */
+    uint64_t currentOut; /**< Bytes checked out, including internal
+        fragmentation */
+    uint64_t currentCount; /**< Number of allocations checked out */
+    uint64_t maxOut; /**< Maximum of currentOut */
+    uint64_t maxCount; /**< Maximum of currentCount */
+    uint64_t maxRequest; /**< Largest allocation request in bytes */
+    uint64_t nLockAcquire; /**< Number of times the pool lock was taken */
+    uint64_t nLockContended; /**< Number of times a built-in lock had to wait
+        before it was taken */
+    uint64_t nLockWaitNs; /**< Time spent waiting for a built-in lock in
+        nanoseconds */
+    uint64_t anAlloc[MPLITE_LOGMAX + 1]; /**< Allocations of each order */
+    uint64_t anFree[MPLITE_LOGMAX + 1]; /**< Frees of each order */
+    uint64_t anSplit[MPLITE_LOGMAX + 1]; /**< Blocks of each order split in
+        halves */
+    uint64_t anCoalesce[MPLITE_LOGMAX + 1]; /**< Blocks of each order formed
+        by merging two free buddies */
+    uint64_t anFreeBlock[MPLITE_LOGMAX + 1]; /**< Free blocks of each order
+        at the time of the snapshot */
+} mplite_stats_t;
+
+/**
+ * @brief Fragmentation report of a @ref mplite_t object, filled in by
+ *        @ref mplite_get_frag. The share of free memory that is unusable for
+ *        a request as large as possible is 1 - nLargestFree / nFreeBytes.
+ */
+typedef struct mplite_frag {
+    uint64_t nPoolBytes; /**< Bytes of memory available for allocation */
+    uint64_t nFreeBytes; /**< Bytes in free blocks */
+    uint64_t nLargestFree; /**< Size in bytes of the largest free block, ie.
+        the largest request that would succeed */
+    int nOrder; /**< Number of orders the pool can hold */
+    uint64_t anFreeBlock[MPLITE_LOGMAX + 1]; /**< Histogram of the free blocks
+        by order: order N holds blocks of (szAtom << N) bytes */
+    uint64_t nRobsonBytes; /**< Pool size that the Robson bound requires for
+        the largest request, capped at the largest block of the pool, and the
+        maximum checkout seen so far. Zero if the bound is not positive. */
+    int64_t nHeadroom; /**< nPoolBytes - nRobsonBytes. While it is not
+        negative, no request up to the largest one seen so far can fail
+        because of fragmentation. */
+} mplite_frag_t;
+
+/**
+ * @brief Block visitor function pointer to be passed to @ref mplite_walk.
+ *        It is called under the pool lock and must not call into the pool.
+ * @param[in] arg Argument given to @ref mplite_walk
+ * @param[in] block Start of the block
+ * @param[in] size Size of the block in bytes
+ * @param[in] used Non-zero if the block is checked out, including blocks
+ *                 held by a @ref mplite_tcache_t or carved by a
+ *                 @ref mplite_slab_t
+ * @return Zero to carry on with the next block, non-zero to stop the walk
+ */
+typedef int (*mplite_walkfunc_t)(void *arg, const void *block,
+                                 const mplite_int_t size, const int used);
+
+/**
+ * @brief Id of a trace record field that refers to no allocation
+ */
+#define MPLITE_TRACE_NONE      ((uint64_t) -1)
+/**
+ * @brief Magic number at the start of a trace file, "MPLTRACE" in memory
+ *        order on little-endian hosts
+ */
+#define MPLITE_TRACE_MAGIC     ((uint64_t) 0x45434152544c504d)
+/**
+ * @brief Version of the trace file layout
+ */
+#define MPLITE_TRACE_VERSION   1
+
+/**
+ * @brief One operation of an allocation trace. Allocations are identified by
+ *        their block index in the recorded pool, which is unique among the
+ *        allocations checked out at any one time. The operation follows from
+ *        the fields:
+ *        - malloc: iId is @ref MPLITE_TRACE_NONE
+ *        - free: nSize is zero
+ *        - realloc: iId is set and nSize is not zero
+ *
+ *        iNewId is @ref MPLITE_TRACE_NONE if a malloc or realloc failed.
+ */
+typedef struct mplite_trace_rec {
+    uint64_t iTime; /**< Nanoseconds since the trace started */
+    uint64_t nSize; /**< Requested size in bytes, zero for a free */
+    uint64_t iId; /**< Id of the allocation passed in */
+    uint64_t iNewId; /**< Id of the allocation handed out */
+} mplite_trace_rec_t;
+
+/**
+ * @brief Allocation trace recorded into a ring of records supplied by the
+ *        caller. When the ring is full the oldest records are overwritten.
+ */
+typedef struct mplite_trace {
+    mplite_trace_rec_t *aRec; /**< Ring of records */
+    uint64_t nRec; /**< Number of records in aRec */
+    uint64_t nTotal; /**< Number of records written so far. The next one goes
+        to aRec[nTotal % nRec]. */
+    uint64_t iStart; /**< Clock reading when the trace started */
+    uint64_t szAtom; /**< mplite_t.szAtom of the recorded pool */
+    uint64_t nBlock; /**< mplite_t.nBlock of the recorded pool, an upper
+        bound of the allocation ids */
+} mplite_trace_t;
+
+/**
+ * @brief Header of a trace file written by @ref mplite_trace_save. The
+ *        records follow it, oldest first.
+ */
+typedef struct mplite_trace_header {
+    uint64_t magic; /**< @ref MPLITE_TRACE_MAGIC */
+    uint32_t version; /**< @ref MPLITE_TRACE_VERSION */
+    uint32_t szRec; /**< sizeof(mplite_trace_rec_t) */
+    uint64_t szAtom; /**< mplite_t.szAtom of the recorded pool */
+    uint64_t nBlock; /**< mplite_t.nBlock of the recorded pool */
+    uint64_t nRec; /**< Number of records in the file */
+    uint64_t nLost; /**< Number of older records overwritten in the ring
+        before the trace was saved */
+} mplite_trace_header_t;
+
 /**
  * @brief Print string function pointer to be passed to @ref mplite_print_stats
  *        function. This must be same as stdio's puts function mechanism which
@@ -148,18 +567,21 @@ extern "C" {
  * @param[in] min_alloc Minimum size of an allocation. Any call to @ref
  *                      mplite_malloc where nBytes is less than min_alloc will
  *                      be rounded up to min_alloc. min_alloc must be a power of
- *                      two.
+ *                      two. A library built with MPLITE_ATOM_SIZE defined fixes
+ *                      the minimum allocation size to that value at compile
+ *                      time and rejects a larger min_alloc.
  * @param[in] lock Pointer to a lock object to control access to the memory
  *                 allocation subsystem of @ref mplite_t object. If this is
  *                 @ref NULL, @ref mplite_t will be non-threadsafe and can only
  *                 be safely used by a single thread. It is safe to allocate
  *                 this in stack because it will be copied to @ref mplite_t
- *                 object.
+ *                 object. Pass @ref MPLITE_LOCK_SPIN, @ref MPLITE_LOCK_FUTEX
+ *                 or @ref MPLITE_LOCK_TICKET instead to use a built-in lock.
  * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
  *         parameters error.
  */
 MPLITE_API int mplite_init(mplite_t *handle, const void *buf,
-                           const int buf_size, const int min_alloc,
+                           const mplite_int_t buf_size, const int min_alloc,
                            const mplite_lock_t *lock);
 
 /**
@@ -168,7 +590,23 @@ MPLITE_API int mplite_init(mplite_t *handle, const void *buf,
  * @param[in] nBytes Number of bytes to allocate
  * @return Non-NULL on success, NULL otherwise
  */
-MPLITE_API void *mplite_malloc(mplite_t *handle, const int nBytes);
+MPLITE_API void *mplite_malloc(mplite_t *handle, const mplite_int_t nBytes);
+
+/**
+ * @brief Allocate bytes of memory aligned to a power of two. An alignment
+ *        larger than the allocation size does not round the allocation up to
+ *        the alignment: the block is carved at an aligned address out of a
+ *        larger free block and the rest stays free.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ * @param[in] alignment Required alignment in bytes. Must be a power of two.
+ * @param[in] nBytes Number of bytes to allocate
+ * @return Non-NULL on success, NULL otherwise. The allocation is released
+ *         with @ref mplite_free. @ref mplite_realloc does not preserve an
+ *         alignment beyond the natural one of the new size.
+ */
+MPLITE_API void *mplite_memalign(mplite_t *handle,
+                                 const mplite_int_t alignment,
+                                 const mplite_int_t nBytes);
 
 /**
  * @brief Free memory
@@ -177,6 +615,36 @@ MPLITE_API void *mplite_malloc(mplite_t *handle, const int nBytes);
  */
 MPLITE_API void mplite_free(mplite_t *handle, const void *pPrior);
 
+/**
+ * @brief Allocate several blocks of the same size under a single lock
+ *        acquisition. Blocks are placed exactly as nCount calls to
+ *        @ref mplite_malloc would place them, but a larger block is split into
+ *        all the siblings needed at once.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ * @param[in] nBytes Number of bytes of each allocation
+ * @param[in] nCount Number of allocations
+ * @param[out] apOut Array of at least nCount entries that receives the
+ *                   allocations. On partial success the entries after the
+ *                   last allocation are set to NULL.
+ * @return Number of allocations made, from zero to nCount. Anything less
+ *         than nCount means the pool ran out of memory.
+ */
+MPLITE_API int mplite_malloc_batch(mplite_t *handle,
+                                   const mplite_int_t nBytes,
+                                   const int nCount, void **apOut);
+
+/**
+ * @brief Free several allocations under a single lock acquisition. Called by
+ *        a thread other than the owner of a pool given a remote-free queue,
+ *        the buffers go onto the queue as with @ref mplite_free.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ * @param[in] apPrior Array of allocated buffers. NULL entries are skipped.
+ * @param[in] nCount Number of entries in apPrior
+ * @return Number of buffers freed, ie. the number of non-NULL entries
+ */
+MPLITE_API int mplite_free_batch(mplite_t *handle, void * const *apPrior,
+                                 const int nCount);
+
 /**
  * @brief Change the size of an existing memory allocation.
  * @param[in,out] handle Pointer to an initialized @ref mplite_t object
@@ -187,10 +655,22 @@ MPLITE_API void mplite_free(mplite_t *handle, const void *pPrior);
  *                   that means that an oversize allocation (an allocation
  *                   larger than @ref MPLITE_MAX_ALLOC_SIZE) was requested and
  *                   this routine should return NULL without freeing pPrior.
+ *
+ * The allocation is resized in place whenever possible. A smaller size gives
+ * the unused tail back to the pool. A larger size absorbs the free buddies
+ * that follow the allocation if they are all free. Otherwise the contents are
+ * copied to a new allocation and pPrior is freed.
+ *
+ * The copy is made without holding the pool lock, so other threads are not
+ * held up by large copies. pPrior stays allocated and its contents are left
+ * untouched until the copy is complete, so concurrent readers of pPrior see
+ * valid data until this function returns. Writes to pPrior made by other
+ * threads during the call may or may not be carried over, just as with the
+ * standard realloc().
  * @return Non-NULL on success, NULL otherwise
  */
 MPLITE_API void *mplite_realloc(mplite_t *handle, const void *pPrior,
-                                const int nBytes);
+                                const mplite_int_t nBytes);
 
 /**
  * @brief Round up a request size to the next valid allocation size.
@@ -199,7 +679,8 @@ MPLITE_API void *mplite_realloc(mplite_t *handle, const void *pPrior,
  * @return Positive non-zero value if the size can be allocated or zero if the
  *         allocation is too large to be handled.
  */
-MPLITE_API int mplite_roundup(mplite_t *handle, const int n);
+MPLITE_API mplite_int_t mplite_roundup(mplite_t *handle,
+                                       const mplite_int_t n);
 
 /**
  * @brief Print the statistics of the memory pool object
@@ -210,11 +691,551 @@ MPLITE_API int mplite_roundup(mplite_t *handle, const int n);
 MPLITE_API void mplite_print_stats(const mplite_t * const handle,
                                    const mplite_putsfunc_t logfunc);
 
+/**
+ * @brief Take a consistent snapshot of the statistics of a memory pool object.
+ *        Where atomic operations are available the snapshot is taken without
+ *        the pool lock: it is retried until it did not overlap an update, so
+ *        a sampler never blocks the threads allocating from the pool.
+ *
+ * In a pool shared between processes the snapshot is taken under the lock.
+ * The totals cover every process, but the per-order activity counters only
+ * cover the calling process. The free block counts always describe the whole
+ * pool.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ * @param[out] stats Pointer to the @ref mplite_stats_t object to fill in
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_get_stats(mplite_t *handle, mplite_stats_t *stats);
+
+/**
+ * @brief Format a statistics snapshot in the Prometheus text exposition
+ *        format, which OpenMetrics scrapers accept as well. Every sample is
+ *        labelled with the pool name, and per-order samples also with the
+ *        order and the block size in bytes.
+ * @param[in] stats Snapshot filled in by @ref mplite_get_stats
+ * @param[in] name Value of the pool label of every sample
+ * @param[out] buf Buffer that receives the NUL-terminated text
+ * @param[in] buf_size Size of buf in bytes
+ * @return Length of the text without the terminating NUL, or
+ *         @ref MPLITE_ERR_INVPAR on invalid parameters or if buf is too
+ *         small.
+ */
+MPLITE_API int mplite_export_stats(const mplite_stats_t *stats,
+                                   const char *name, char *buf,
+                                   const int buf_size);
+
+/**
+ * @brief Visit every block of a memory pool object, free or used, in
+ *        address order. The pool is locked for the whole walk.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ * @param[in] walkfunc Non-NULL function called for each block. Refer to
+ *                     @ref mplite_walkfunc_t for its prototype.
+ * @param[in] arg Argument passed to walkfunc
+ * @return Number of blocks visited, or @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API mplite_int_t mplite_walk(mplite_t *handle,
+                                    const mplite_walkfunc_t walkfunc,
+                                    void *arg);
+
+/**
+ * @brief Report the fragmentation of a memory pool object. The report is
+ *        derived from a @ref mplite_get_stats snapshot and costs a pass over
+ *        the block orders, not over the pool.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ * @param[out] frag Pointer to the @ref mplite_frag_t object to fill in
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_get_frag(mplite_t *handle, mplite_frag_t *frag);
+
+/**
+ * @brief Start recording the calls to @ref mplite_malloc, @ref mplite_free
+ *        and @ref mplite_realloc of a memory pool object. The other
+ *        allocation functions are not recorded. Recording costs a clock
+ *        reading per call, under the pool lock.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ *                       without regions added by @ref mplite_add_region
+ * @param[out] trace Pointer to the @ref mplite_trace_t object to record into.
+ *                   It must stay valid until @ref mplite_trace_stop.
+ * @param[in] aRec Ring of nRec records
+ * @param[in] nRec Number of records in aRec
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_trace_start(mplite_t *handle, mplite_trace_t *trace,
+                                  mplite_trace_rec_t *aRec,
+                                  const uint64_t nRec);
+
+/**
+ * @brief Stop recording the trace of a memory pool object
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_trace_stop(mplite_t *handle);
+
+/**
+ * @brief Write a trace to a file, to be replayed by test/replay.c. A trace
+ *        should be stopped before it is saved.
+ * @param[in] trace Trace recorded by @ref mplite_trace_start
+ * @param[in] path Path of the file to create or truncate
+ * @return @ref MPLITE_OK on success, @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters and @ref MPLITE_ERR_FILE if the file cannot be written.
+ */
+MPLITE_API int mplite_trace_save(const mplite_trace_t *trace,
+                                 const char *path);
+
+/**
+ * @brief Return the size of the largest free block of a memory pool object,
+ *        ie. the largest request that would currently succeed, in constant
+ *        time.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ * @return Size in bytes, or zero if the pool is full or handle is NULL
+ */
+MPLITE_API mplite_int_t mplite_largest_free(mplite_t *handle);
+
+/**
+ * @brief Grow a memory pool object by another buffer.
+ *
+ *        The buffer becomes a region of the pool with its own blocks and
+ *        bookkeeping, which take the start of the buffer. Allocations are
+ *        served from the buffer given to @ref mplite_init first and then from
+ *        the regions in the order they were added. Freeing, resizing and
+ *        every other call find the region of an allocation from its address,
+ *        so live allocations are kept as the pool grows. The statistics cover
+ *        the pool and all its regions. A block never spans two regions, so a
+ *        request is limited by the largest single region.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object. Not
+ *                       available for persistent or shared pools, nor while a
+ *                       trace is being recorded.
+ * @param[in] buf Buffer to add, which must not overlap the pool or its other
+ *                regions and must outlive the pool
+ * @param[in] buf_size Size of the buffer in bytes
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error, including when the pool already has
+ *         @ref MPLITE_REGION_MAX regions or the buffer is too small to hold
+ *         a block after the bookkeeping.
+ */
+MPLITE_API int mplite_add_region(mplite_t *handle, void *buf,
+                                 const mplite_int_t buf_size);
+
+/**
+ * @brief Free every block of a memory pool object at once, returning it and
+ *        its regions to the state @ref mplite_init and
+ *        @ref mplite_add_region left them in. The blocks are not visited, so
+ *        this takes the same time however many are checked out. The
+ *        counters of past activity, the lock and the settings of the pool
+ *        are kept. Blocks held by a @ref mplite_tcache_t or a
+ *        @ref mplite_slab_t of the pool are freed too, so those must be
+ *        initialized again before use.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object. Not
+ *                       available for persistent or shared pools, nor while a
+ *                       trace is being recorded.
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_reset(mplite_t *handle);
+
+/**
+ * @brief Return the size in bytes of the buffer that @ref mplite_mark needs
+ *        for a memory pool object. It grows with every region added.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ * @return Size in bytes, or zero on invalid parameters error.
+ */
+MPLITE_API mplite_int_t mplite_mark_size(mplite_t *handle);
+
+/**
+ * @brief Set a checkpoint that @ref mplite_release_to_mark rolls a memory
+ *        pool object back to.
+ *
+ *        The mark is a copy of the bookkeeping of the pool and its regions,
+ *        about one byte per mplite_t.szAtom bytes of pool, so setting it and
+ *        releasing to it take time in proportion to the size of the pool and
+ *        not to the number of blocks allocated in between. Marks nest. Each
+ *        one needs its own buffer. The buffer may itself be allocated from
+ *        the pool before the mark is set.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object. Not
+ *                       available for persistent or shared pools, nor while a
+ *                       trace is being recorded.
+ * @param[out] mark Buffer to hold the mark, aligned to 8 bytes
+ * @param[in] mark_size Size of the buffer in bytes, at least
+ *                      @ref mplite_mark_size
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_mark(mplite_t *handle, void *mark,
+                           const mplite_int_t mark_size);
+
+/**
+ * @brief Roll a memory pool object back to a checkpoint set by
+ *        @ref mplite_mark, freeing every block allocated since without
+ *        visiting them. Blocks checked out when the mark was set are checked
+ *        out again, even if they were freed in between, so they should be
+ *        kept until the release. Regions added since the mark are kept and
+ *        emptied. Marks set since are no longer valid. The same caveats about
+ *        caches and slabs as for @ref mplite_reset apply.
+ * @param[in,out] handle Pointer to the @ref mplite_t object the mark was set
+ *                       on
+ * @param[in] mark Buffer filled in by @ref mplite_mark
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error, including a mark set on another pool.
+ */
+MPLITE_API int mplite_release_to_mark(mplite_t *handle, const void *mark);
+
+/**
+ * @brief Turn lazy coalescing on or off for a memory pool object.
+ *
+ *        With lazy coalescing, a freed block of one of the nOrder smallest
+ *        orders goes onto a quick list of its order instead of being merged
+ *        with its buddy, and the next request of that order takes it back
+ *        without splitting anything. The blocks of a quick list are coalesced
+ *        in one go when the list grows past nHighWater blocks, and all quick
+ *        lists are coalesced when a request cannot be served otherwise, so a
+ *        request never fails for lack of the merged memory.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object. Not
+ *                       available for persistent or shared pools.
+ * @param[in] nOrder Number of orders with a quick list, up to
+ *                   @ref MPLITE_QUICK_ORDERS. Zero turns lazy coalescing off
+ *                   and coalesces every quick list.
+ * @param[in] nHighWater Maximum number of blocks on a quick list. Zero
+ *                       selects @ref MPLITE_QUICK_MAX.
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_lazy_init(mplite_t *handle, const int nOrder,
+                                const int nHighWater);
+
+/**
+ * @brief Coalesce every block on the quick lists of a memory pool object
+ *        with its free buddies, after giving back the blocks waiting on its
+ *        remote-free queue.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ */
+MPLITE_API void mplite_coalesce(mplite_t *handle);
+
+/**
+ * @brief Give a memory pool object a remote-free queue and make the calling
+ *        thread its owner.
+ *
+ *        From then on, @ref mplite_free, @ref mplite_free_batch and the
+ *        flushes of a per-thread cache called by any other thread push the
+ *        blocks onto a lock-free queue instead of taking the pool lock. Only
+ *        the owner drains the queue, on its next allocation from the pool or
+ *        on its next free once the queue holds nThreshold blocks, so a pool
+ *        that only the owner allocates from needs no lock. A slab front-end
+ *        on such a pool must then be used by the owner alone. Until then the
+ *        queued blocks are still counted as checked out. The queue stays for
+ *        the life of the pool.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object. Not
+ *                       available for persistent or shared pools, nor where
+ *                       the compiler offers no atomic operations.
+ * @param[in] nThreshold Number of queued blocks that makes a free by the
+ *                       owner drain the queue. Zero selects
+ *                       @ref MPLITE_REMOTE_MAX.
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_remote_init(mplite_t *handle, const int nThreshold);
+
+/**
+ * @brief Initialize a per-thread allocation cache.
+ * @param[in,out] cache Pointer to a @ref mplite_tcache_t object, typically
+ *                      kept in thread-local storage
+ * @param[in] handle Pointer to an initialized @ref mplite_t object. The pool
+ *                   must have a lock if it is shared by several caches.
+ * @param[in] capacity Maximum number of blocks kept per order. Zero selects
+ *                     @ref MPLITE_TCACHE_CAPACITY.
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_tcache_init(mplite_tcache_t *cache, mplite_t *handle,
+                                  const int capacity);
+
+/**
+ * @brief Allocate bytes of memory through a per-thread cache
+ * @param[in,out] cache Pointer to an initialized @ref mplite_tcache_t object
+ * @param[in] nBytes Number of bytes to allocate
+ * @return Non-NULL on success, NULL otherwise
+ */
+MPLITE_API void *mplite_tcache_malloc(mplite_tcache_t *cache,
+                                      const mplite_int_t nBytes);
+
+/**
+ * @brief Free memory through a per-thread cache. The memory may have been
+ *        allocated by any cache or directly from the same pool.
+ * @param[in,out] cache Pointer to an initialized @ref mplite_tcache_t object
+ * @param[in] pPrior Allocated buffer
+ */
+MPLITE_API void mplite_tcache_free(mplite_tcache_t *cache, const void *pPrior);
+
+/**
+ * @brief Return every block held by a per-thread cache to its pool. The cache
+ *        stays usable.
+ * @param[in,out] cache Pointer to an initialized @ref mplite_tcache_t object
+ */
+MPLITE_API void mplite_tcache_flush(mplite_tcache_t *cache);
+
+/**
+ * @brief Thread exit hook that flushes a per-thread cache. The prototype
+ *        matches the destructor of pthread_key_create() and the callback of
+ *        FlsAlloc() so it can be registered with either directly.
+ * @param[in,out] cache Pointer to an initialized @ref mplite_tcache_t object
+ */
+MPLITE_API void mplite_tcache_exit(void *cache);
+
+/**
+ * @brief Initialize a set of memory pools by splitting one buffer into equal
+ *        shards.
+ * @param[in,out] set Pointer to a @ref mplite_set_t object
+ * @param[in,out] shards Array of nShard @ref mplite_t objects that become the
+ *                       shards. It must outlive the set.
+ * @param[in] nShard Number of shards, from 1 to @ref MPLITE_SET_MAX
+ * @param[in] buf Memory to be split among the shards
+ * @param[in] buf_size The number of bytes of memory space pointed to by buf
+ * @param[in] min_alloc Minimum size of an allocation. Refer to
+ *                      @ref mplite_init.
+ * @param[in] locks Array of nShard lock objects, one per shard, or NULL if the
+ *                  set is only used by a single thread. A built-in lock such
+ *                  as @ref MPLITE_LOCK_SPIN gives every shard a lock of its
+ *                  own of that kind.
+ * @param[in] affinity @ref MPLITE_AFFINITY_THREAD or @ref MPLITE_AFFINITY_CPU
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_set_init(mplite_set_t *set, mplite_t *shards,
+                               const int nShard, const void *buf,
+                               const mplite_int_t buf_size,
+                               const int min_alloc,
+                               const mplite_lock_t *locks, const int affinity);
+
+/**
+ * @brief Initialize a set of memory pools with one buffer per shard.
+ * @param[in,out] set Pointer to a @ref mplite_set_t object
+ * @param[in,out] shards Array of nShard @ref mplite_t objects that become the
+ *                       shards. It must outlive the set.
+ * @param[in] nShard Number of shards, from 1 to @ref MPLITE_SET_MAX
+ * @param[in] bufs Array of nShard non-overlapping buffers
+ * @param[in] buf_sizes Array of the sizes in bytes of each buffer
+ * @param[in] min_alloc Minimum size of an allocation. Refer to
+ *                      @ref mplite_init.
+ * @param[in] locks Array of nShard lock objects, one per shard, or NULL if the
+ *                  set is only used by a single thread. A built-in lock such
+ *                  as @ref MPLITE_LOCK_SPIN gives every shard a lock of its
+ *                  own of that kind.
+ * @param[in] affinity @ref MPLITE_AFFINITY_THREAD or @ref MPLITE_AFFINITY_CPU
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_set_init_multi(mplite_set_t *set, mplite_t *shards,
+                                     const int nShard,
+                                     const void * const *bufs,
+                                     const mplite_int_t *buf_sizes,
+                                     const int min_alloc,
+                                     const mplite_lock_t *locks,
+                                     const int affinity);
+
+/**
+ * @brief Allocate bytes of memory from the home shard of the calling thread,
+ *        or from any other shard if the home shard is exhausted.
+ * @param[in,out] set Pointer to an initialized @ref mplite_set_t object
+ * @param[in] nBytes Number of bytes to allocate
+ * @return Non-NULL on success, NULL otherwise
+ */
+MPLITE_API void *mplite_set_malloc(mplite_set_t *set,
+                                   const mplite_int_t nBytes);
+
+/**
+ * @brief Free memory allocated from any shard of a set
+ * @param[in,out] set Pointer to an initialized @ref mplite_set_t object
+ * @param[in] pPrior Allocated buffer
+ */
+MPLITE_API void mplite_set_free(mplite_set_t *set, const void *pPrior);
+
+/**
+ * @brief Give every shard of a set a remote-free queue. From then on,
+ *        @ref mplite_set_free of memory owned by a shard other than the home
+ *        shard of the calling thread pushes it onto the queue of its shard
+ *        without taking the shard lock. See @ref mplite_remote_init. The
+ *        thread whose free brings the queue of a shard to nThreshold blocks
+ *        drains it under the shard lock. A shard without a lock is left for
+ *        its next allocation to drain.
+ * @param[in,out] set Pointer to an initialized @ref mplite_set_t object
+ * @param[in] nThreshold Number of queued blocks that makes a freeing thread
+ *                       drain the queue of a shard. Zero selects
+ *                       @ref MPLITE_REMOTE_MAX.
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_set_remote_init(mplite_set_t *set,
+                                      const int nThreshold);
+
+/**
+ * @brief Find the shard that owns an allocation
+ * @param[in] set Pointer to an initialized @ref mplite_set_t object
+ * @param[in] p Allocated buffer
+ * @return The owning shard, or NULL if p does not belong to the set
+ */
+MPLITE_API mplite_t *mplite_set_shard(const mplite_set_t *set, const void *p);
+
+/**
+ * @brief Initialize a slab front-end.
+ * @param[in,out] slab Pointer to a @ref mplite_slab_t object
+ * @param[in] handle Pointer to an initialized @ref mplite_t object
+ * @param[in] sizes Array of slot sizes in ascending order. Each is rounded up
+ *                  to a multiple of 8 bytes. NULL selects a default set of
+ *                  classes from 16 to 448 bytes spaced a quarter of a power of
+ *                  two apart.
+ * @param[in] nSize Number of entries in sizes, up to
+ *                  @ref MPLITE_SLAB_CLASSES. Ignored if sizes is NULL.
+ * @param[in] slab_size Size of each slab in bytes, rounded up to a valid
+ *                      allocation size of the pool. Zero selects
+ *                      @ref MPLITE_SLAB_SIZE. A slab must hold at least two
+ *                      slots of the largest class.
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_slab_init(mplite_slab_t *slab, mplite_t *handle,
+                                const int *sizes, const int nSize,
+                                const mplite_int_t slab_size);
+
+/**
+ * @brief Allocate bytes of memory from the smallest size class that fits.
+ *        Requests larger than the largest class, or made while the pool has
+ *        no room for a new slab, are served by the pool directly.
+ * @param[in,out] slab Pointer to an initialized @ref mplite_slab_t object
+ * @param[in] nBytes Number of bytes to allocate
+ * @return Non-NULL on success, NULL otherwise
+ */
+MPLITE_API void *mplite_slab_malloc(mplite_slab_t *slab,
+                                    const mplite_int_t nBytes);
+
+/**
+ * @brief Free memory allocated by @ref mplite_slab_malloc. Memory from slots
+ *        must be freed here and never with @ref mplite_free or resized with
+ *        @ref mplite_realloc. Other allocations of the pool are passed on to
+ *        @ref mplite_free.
+ * @param[in,out] slab Pointer to an initialized @ref mplite_slab_t object
+ * @param[in] pPrior Allocated buffer
+ */
+MPLITE_API void mplite_slab_free(mplite_slab_t *slab, const void *pPrior);
+
+/**
+ * @brief Create a persistent pool in a memory-mapped file. The file starts
+ *        with a header of @ref MPLITE_FILE_HEADER bytes followed by the pool.
+ *        Refer to @ref mplite_attach to reopen the pool later.
+ * @param[in,out] handle Pointer to a @ref mplite_t object
+ * @param[in] path Path of the file. An existing file is truncated.
+ * @param[in] file_size Size of the file in bytes, header included
+ * @param[in] min_alloc Minimum size of an allocation. Refer to
+ *                      @ref mplite_init.
+ * @param[in] lock Pointer to a lock object or NULL. Refer to
+ *                 @ref mplite_init.
+ * @return @ref MPLITE_OK on success, @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error and @ref MPLITE_ERR_FILE if the file cannot be
+ *         created or mapped.
+ */
+MPLITE_API int mplite_init_file(mplite_t *handle, const char *path,
+                                const mplite_int_t file_size,
+                                const int min_alloc,
+                                const mplite_lock_t *lock);
+
+/**
+ * @brief Reopen a persistent pool created by @ref mplite_init_file. Blocks
+ *        allocated before the pool was detached are still allocated and keep
+ *        their contents. The file may be mapped at a different address, so
+ *        allocations that must outlive the process should be kept as offsets.
+ *        Refer to @ref mplite_offset and @ref mplite_pointer.
+ *
+ * The file is refused if it was not detached cleanly, for example because
+ * the process that had it attached crashed. Slab front-ends are not
+ * persistent and must not be used on a persistent pool.
+ * @param[in,out] handle Pointer to a @ref mplite_t object
+ * @param[in] path Path of the file
+ * @param[in] lock Pointer to a lock object or NULL. Refer to
+ *                 @ref mplite_init.
+ * @return @ref MPLITE_OK on success, @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error and @ref MPLITE_ERR_FILE if the file cannot be
+ *         mapped or does not hold a valid pool.
+ */
+MPLITE_API int mplite_attach(mplite_t *handle, const char *path,
+                             const mplite_lock_t *lock);
+
+/**
+ * @brief Create a pool in a POSIX shared memory object that several processes
+ *        can allocate from at once. The pool state lives in the segment and is
+ *        guarded by a robust process-shared mutex, so the handle must not be
+ *        given a lock of its own, nor be moved or copied while attached.
+ *        Every process maps the segment at its own address, so allocations
+ *        travel between processes as offsets. Refer to @ref mplite_offset and
+ *        @ref mplite_pointer.
+ *
+ * If a process dies while holding the mutex, the next process to take it
+ * rebuilds the free lists from the bitmaps in the segment before going on, so
+ * no block is handed out twice. The blocks the dead process was allocating or
+ * freeing may be lost to the pool, and the checkout statistics may count them.
+ *
+ * Remove the segment with shm_unlink() once it is no longer needed. Slab
+ * front-ends and per-thread caches keep process-local pointers and must not
+ * be shared between processes. Not available on Windows.
+ * @param[in,out] handle Pointer to a @ref mplite_t object
+ * @param[in] name Name of the shared memory object as given to shm_open().
+ *                 An existing object is truncated.
+ * @param[in] shm_size Size of the segment in bytes, header included
+ * @param[in] min_alloc Minimum size of an allocation. Refer to
+ *                      @ref mplite_init.
+ * @return @ref MPLITE_OK on success, @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error and @ref MPLITE_ERR_FILE if the segment cannot be
+ *         created or mapped.
+ */
+MPLITE_API int mplite_init_shared(mplite_t *handle, const char *name,
+                                  const mplite_int_t shm_size,
+                                  const int min_alloc);
+
+/**
+ * @brief Attach another process, or another handle, to a pool created by
+ *        @ref mplite_init_shared.
+ * @param[in,out] handle Pointer to a @ref mplite_t object
+ * @param[in] name Name of the shared memory object
+ * @return @ref MPLITE_OK on success, @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error and @ref MPLITE_ERR_FILE if the segment cannot be
+ *         mapped or does not hold a shared pool.
+ */
+MPLITE_API int mplite_attach_shared(mplite_t *handle, const char *name);
+
+/**
+ * @brief Detach from a persistent or shared pool and unmap it. A persistent
+ *        pool is written back to its file and the file stamped as valid. The
+ *        handle cannot be used afterwards.
+ * @param[in,out] handle Pointer to a @ref mplite_t object initialized by
+ *                       @ref mplite_init_file, @ref mplite_attach,
+ *                       @ref mplite_init_shared or @ref mplite_attach_shared
+ * @return @ref MPLITE_OK on success, @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error and @ref MPLITE_ERR_FILE if the pool could not be
+ *         written to the file.
+ */
+MPLITE_API int mplite_detach(mplite_t *handle);
+
 /**
  * @brief Macro to return the number of times mplite_malloc() has been called.
  */
 #define mplite_alloc_count(handle)    (((handle) != NULL)? (handle)->nAlloc : 0)
 
+/**
+ * @brief Macro to return the offset of an allocation from the start of the
+ *        pool. Offsets stay valid when a persistent pool is mapped again and
+ *        in every process attached to a shared pool.
+ */
+#define mplite_offset(handle, p) \
+        ((mplite_int_t) ((const uint8_t *) (p) - (handle)->zPool))
+
+/**
+ * @brief Macro to return the allocation at an offset from the start of the
+ *        pool. This is the inverse of @ref mplite_offset.
+ */
+#define mplite_pointer(handle, offset)    ((void *) ((handle)->zPool + (offset)))
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,488 @@
+/**
+ * The author disclaims copyright to this source code.  In place of
+ * a legal notice, here is a blessing:
+ *
+ *    May you do good and not evil.
+ *    May you find forgiveness for yourself and forgive others.
+ *    May you share freely, never taking more than you give.
+ *
+ * This file contains a header-only C++ binding of the memory allocation
+ * subsystem declared in mplite.h:
+ *
+ *   mplite::pool             RAII owner of a mplite_t object and, optionally,
+ *                            of the buffer it allocates from.
+ *   mplite::static_pool      Pool whose atom size and buffer size are
+ *                            template arguments, with the buffer inside.
+ *   mplite::allocator<T>     Stateful allocator for standard containers that
+ *                            calls the pool directly.
+ *   mplite::memory_resource  std::pmr::memory_resource over a pool, for the
+ *                            polymorphic containers of C++17.
+ *
+ * Allocation and deallocation through the pool never throw. The allocator
+ * and the memory resource throw std::bad_alloc when the pool is exhausted,
+ * as their standard interfaces require. None of them adds locking of its
+ * own: a pool shared by several threads needs a lock given to its
+ * constructor.
+ */
+#ifndef MPLITE_HPP
+#define MPLITE_HPP
+
+#include "mplite.h"
+
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+
+/**
+ * @brief Defined to 1 if std::pmr::memory_resource is available, in which
+ *        case @ref mplite::memory_resource is declared
+ */
+#ifndef MPLITE_HAVE_PMR
+#if defined(_MSVC_LANG) && (_MSVC_LANG >= 201703L)
+#define MPLITE_HAVE_PMR 1
+#elif (__cplusplus >= 201703L) && defined(__has_include)
+#if __has_include(<memory_resource>)
+#define MPLITE_HAVE_PMR 1
+#endif
+#endif
+#endif /* #ifndef MPLITE_HAVE_PMR */
+
+#if MPLITE_HAVE_PMR
+#include <memory_resource>
+#endif /* #if MPLITE_HAVE_PMR */
+
+namespace mplite {
+
+namespace detail {
+
+/* Alignment of the start of a pool or region */
+inline std::size_t base_align(const mplite_t *handle) noexcept
+{
+    return static_cast<std::size_t>(
+            reinterpret_cast<uintptr_t>(handle->zPool) &
+            (0 - reinterpret_cast<uintptr_t>(handle->zPool)));
+}
+
+/*
+ ** Allocate nByte bytes aligned to nAlign from a pool. A block is aligned to
+ ** its own size relative to the start of the pool or region it lies in, and
+ ** mplite_malloc may serve the request from any of them. So a request
+ ** rounded up to the alignment only needs the slower aligned allocation when
+ ** the start of the pool or of one of its regions is less aligned than that.
+ */
+inline void *allocate(mplite_t *handle, std::size_t nByte,
+                      std::size_t nAlign) noexcept
+{
+    std::size_t nBase = base_align(handle);
+
+    for (int ii = 0; ii < handle->nRegion; ii++) {
+        const std::size_t nRegionBase = base_align(handle->apRegion[ii]);
+        if (nRegionBase < nBase) {
+            nBase = nRegionBase;
+        }
+    }
+
+    if (nByte < nAlign) {
+        nByte = nAlign;
+    }
+    if ((0 == nByte) ||
+        (nByte > static_cast<std::size_t>(
+                 std::numeric_limits<mplite_int_t>::max()))) {
+        return nullptr;
+    }
+    if (nAlign <= nBase) {
+        return mplite_malloc(handle, static_cast<mplite_int_t>(nByte));
+    }
+    return mplite_memalign(handle, static_cast<mplite_int_t>(nAlign),
+                           static_cast<mplite_int_t>(nByte));
+}
+
+[[noreturn]] inline void throw_bad_alloc()
+{
+    throw std::bad_alloc();
+}
+
+/* Log2 of n rounded down, evaluated at compile time where n is a constant */
+constexpr int log2_floor(std::size_t n) noexcept
+{
+    return (n <= 1) ? 0 : 1 + log2_floor(n >> 1);
+}
+
+/* Smallest power of two of at least n that is a multiple of p */
+constexpr std::size_t ceil_pow2(std::size_t n, std::size_t p = 1) noexcept
+{
+    return (p >= n) ? p : ceil_pow2(n, p << 1);
+}
+
+} /* namespace detail */
+
+/**
+ * @brief Memory pool that owns its @ref mplite_t object and either owns or
+ *        borrows the buffer it allocates from. A pool can be moved but not
+ *        copied. Its @ref mplite_t object stays at the same address for the
+ *        life of the pool, even across moves, so allocators and memory
+ *        resources taken from it stay valid. A moved-from pool may only be
+ *        destroyed or assigned to.
+ */
+class pool {
+public:
+    /**
+     * @brief Create a pool over a buffer of its own
+     * @param[in] size Size of the buffer in bytes
+     * @param[in] min_alloc Minimum allocation size in bytes
+     * @param[in] lock Lock given to @ref mplite_init, NULL for none
+     * @throw std::bad_alloc if the buffer cannot be allocated
+     * @throw std::invalid_argument if @ref mplite_init rejects the parameters
+     */
+    explicit pool(std::size_t size, int min_alloc = 16,
+                  const mplite_lock_t *lock = nullptr)
+        : handle_(new mplite_t()), buffer_(new char[size])
+    {
+        init(buffer_.get(), size, min_alloc, lock);
+    }
+
+    /**
+     * @brief Create a pool over a buffer owned by the caller, which must
+     *        outlive the pool
+     * @param[in] buf Buffer to allocate from
+     * @param[in] size Size of the buffer in bytes
+     * @param[in] min_alloc Minimum allocation size in bytes
+     * @param[in] lock Lock given to @ref mplite_init, NULL for none
+     * @throw std::invalid_argument if @ref mplite_init rejects the parameters
+     */
+    pool(void *buf, std::size_t size, int min_alloc = 16,
+         const mplite_lock_t *lock = nullptr)
+        : handle_(new mplite_t())
+    {
+        init(buf, size, min_alloc, lock);
+    }
+
+    pool(pool &&) noexcept = default;
+    pool &operator=(pool &&) noexcept = default;
+    pool(const pool &) = delete;
+    pool &operator=(const pool &) = delete;
+
+    /**
+     * @brief Allocate bytes of memory
+     * @return Non-NULL on success, NULL otherwise
+     */
+    void *allocate(std::size_t nBytes) noexcept
+    {
+        return detail::allocate(handle_.get(), nBytes, 1);
+    }
+
+    /**
+     * @brief Allocate bytes of memory at an address that is a multiple of
+     *        alignment, a power of two
+     * @return Non-NULL on success, NULL otherwise
+     */
+    void *allocate(std::size_t nBytes, std::size_t alignment) noexcept
+    {
+        return detail::allocate(handle_.get(), nBytes, alignment);
+    }
+
+    /**
+     * @brief Free memory allocated from this pool. NULL is ignored.
+     */
+    void deallocate(const void *p) noexcept
+    {
+        mplite_free(handle_.get(), p);
+    }
+
+    /**
+     * @brief Return the underlying @ref mplite_t object for the rest of the
+     *        C API
+     */
+    mplite_t *get() const noexcept
+    {
+        return handle_.get();
+    }
+
+    /**
+     * @brief Copy the performance statistics of the pool
+     */
+    mplite_stats_t stats() const noexcept
+    {
+        mplite_stats_t s;
+
+        mplite_get_stats(handle_.get(), &s);
+        return s;
+    }
+
+private:
+    void init(void *buf, std::size_t size, int min_alloc,
+              const mplite_lock_t *lock)
+    {
+        if ((size > static_cast<std::size_t>(
+                    std::numeric_limits<mplite_int_t>::max())) ||
+            (mplite_init(handle_.get(), buf, static_cast<mplite_int_t>(size),
+                         min_alloc, lock) != MPLITE_OK)) {
+            throw std::invalid_argument("mplite_init");
+        }
+    }
+
+    std::unique_ptr<mplite_t> handle_;
+    std::unique_ptr<char[]> buffer_;
+};
+
+/**
+ * @brief Memory pool whose atom size and buffer size are fixed at compile
+ *        time. The buffer is a member, so the pool lives wherever the object
+ *        does, typically in static storage, and needs no heap. Block sizes
+ *        and orders of requests known at compile time can be computed at
+ *        compile time. Build mplite.c with MPLITE_ATOM_SIZE defined to
+ *        AtomSize to have the library turn its block indexing into shifts by
+ *        a constant as well. A static pool can be neither copied nor moved.
+ * @tparam AtomSize Smallest block size in bytes, a power of two of at least 8
+ * @tparam PoolBytes Size in bytes of the buffer, bookkeeping included
+ */
+template <std::size_t AtomSize, std::size_t PoolBytes>
+class static_pool {
+    static_assert((AtomSize >= 8) && ((AtomSize & (AtomSize - 1)) == 0),
+                  "AtomSize must be a power of two of at least 8");
+    static_assert(PoolBytes > AtomSize, "PoolBytes must exceed AtomSize");
+#ifdef MPLITE_ATOM_SIZE
+    static_assert(AtomSize == MPLITE_ATOM_SIZE,
+                  "AtomSize must be the MPLITE_ATOM_SIZE of the library");
+#endif /* #ifdef MPLITE_ATOM_SIZE */
+
+public:
+    static constexpr std::size_t atom_size = AtomSize;
+    static constexpr int atom_log = detail::log2_floor(AtomSize);
+    static constexpr std::size_t pool_bytes = PoolBytes;
+
+    /**
+     * @brief Return the size of the block that serves a request of n bytes
+     */
+    static constexpr std::size_t block_size(std::size_t n) noexcept
+    {
+        return detail::ceil_pow2(n, AtomSize);
+    }
+
+    /**
+     * @brief Return the order of the block that serves a request of n bytes,
+     *        ie. the log2 of its size over the atom size
+     */
+    static constexpr int order(std::size_t n) noexcept
+    {
+        return detail::log2_floor(block_size(n)) - atom_log;
+    }
+
+    /**
+     * @brief Set up the pool over its own buffer
+     * @param[in] lock Lock given to @ref mplite_init, NULL for none. If
+     *                 @ref mplite_init rejects it, every allocation fails.
+     */
+    explicit static_pool(const mplite_lock_t *lock = nullptr) noexcept
+    {
+        mplite_init(&handle_, buf_, static_cast<mplite_int_t>(PoolBytes),
+                    static_cast<int>(AtomSize), lock);
+    }
+
+    static_pool(const static_pool &) = delete;
+    static_pool &operator=(const static_pool &) = delete;
+
+    /**
+     * @brief Allocate bytes of memory
+     * @return Non-NULL on success, NULL otherwise
+     */
+    void *allocate(std::size_t nBytes) noexcept
+    {
+        return detail::allocate(&handle_, nBytes, 1);
+    }
+
+    /**
+     * @brief Allocate bytes of memory at an address that is a multiple of
+     *        alignment, a power of two
+     * @return Non-NULL on success, NULL otherwise
+     */
+    void *allocate(std::size_t nBytes, std::size_t alignment) noexcept
+    {
+        return detail::allocate(&handle_, nBytes, alignment);
+    }
+
+    /**
+     * @brief Free memory allocated from this pool. NULL is ignored.
+     */
+    void deallocate(const void *p) noexcept
+    {
+        mplite_free(&handle_, p);
+    }
+
+    /**
+     * @brief Return the index of the block at p in units of the atom size
+     */
+    std::size_t index(const void *p) const noexcept
+    {
+        return static_cast<std::size_t>(static_cast<const uint8_t *>(p) -
+                                        handle_.zPool) >> atom_log;
+    }
+
+    /**
+     * @brief Return the underlying @ref mplite_t object for the rest of the
+     *        C API, the allocator and the memory resource
+     */
+    mplite_t *get() noexcept
+    {
+        return &handle_;
+    }
+
+private:
+    mplite_t handle_;
+    alignas(MPLITE_CACHE_LINE) unsigned char buf_[PoolBytes];
+};
+
+template <std::size_t AtomSize, std::size_t PoolBytes>
+constexpr std::size_t static_pool<AtomSize, PoolBytes>::atom_size;
+template <std::size_t AtomSize, std::size_t PoolBytes>
+constexpr int static_pool<AtomSize, PoolBytes>::atom_log;
+template <std::size_t AtomSize, std::size_t PoolBytes>
+constexpr std::size_t static_pool<AtomSize, PoolBytes>::pool_bytes;
+
+/**
+ * @brief Stateful allocator that serves a standard container from a pool.
+ *        Each allocation is a direct call into the pool, with no virtual
+ *        dispatch. Two allocators are equal if they use the same pool.
+ */
+template <class T>
+class allocator {
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    typedef std::false_type is_always_equal;
+
+    /**
+     * @brief Allocate from the given pool, which must outlive the allocator
+     */
+    allocator(pool &p) noexcept : handle_(p.get())
+    {
+    }
+
+    /**
+     * @brief Allocate from an initialized @ref mplite_t object, which must
+     *        outlive the allocator
+     */
+    explicit allocator(mplite_t *handle) noexcept : handle_(handle)
+    {
+    }
+
+    template <class U>
+    allocator(const allocator<U> &other) noexcept : handle_(other.get())
+    {
+    }
+
+    /**
+     * @brief Allocate room for n objects of type T
+     * @throw std::bad_alloc if the pool cannot satisfy the request
+     */
+    T *allocate(std::size_t n)
+    {
+        void *p = nullptr;
+
+        if (n <= std::numeric_limits<std::size_t>::max() / sizeof (T)) {
+            p = detail::allocate(handle_, n * sizeof (T), alignof(T));
+        }
+        if (nullptr == p) {
+            detail::throw_bad_alloc();
+        }
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, std::size_t) noexcept
+    {
+        mplite_free(handle_, p);
+    }
+
+    /**
+     * @brief Return the @ref mplite_t object allocated from
+     */
+    mplite_t *get() const noexcept
+    {
+        return handle_;
+    }
+
+private:
+    mplite_t *handle_;
+};
+
+template <class T, class U>
+inline bool operator==(const allocator<T> &a, const allocator<U> &b) noexcept
+{
+    return a.get() == b.get();
+}
+
+template <class T, class U>
+inline bool operator!=(const allocator<T> &a, const allocator<U> &b) noexcept
+{
+    return a.get() != b.get();
+}
+
+#if MPLITE_HAVE_PMR
+/**
+ * @brief Polymorphic memory resource that allocates from a pool. The class
+ *        is final, so calls made through a memory_resource of this exact type
+ *        can be resolved without a virtual call. Two resources are equal if
+ *        they use the same pool.
+ */
+class memory_resource final : public std::pmr::memory_resource {
+public:
+    /**
+     * @brief Allocate from the given pool, which must outlive the resource
+     */
+    explicit memory_resource(pool &p) noexcept : handle_(p.get())
+    {
+    }
+
+    /**
+     * @brief Allocate from an initialized @ref mplite_t object, which must
+     *        outlive the resource
+     */
+    explicit memory_resource(mplite_t *handle) noexcept : handle_(handle)
+    {
+    }
+
+    /**
+     * @brief Return the @ref mplite_t object allocated from
+     */
+    mplite_t *get() const noexcept
+    {
+        return handle_;
+    }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        void *p = detail::allocate(handle_, bytes, alignment);
+
+        if (nullptr == p) {
+            detail::throw_bad_alloc();
+        }
+        return p;
+    }
+
+    void do_deallocate(void *p, std::size_t, std::size_t) override
+    {
+        mplite_free(handle_, p);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const
+            noexcept override
+    {
+        const memory_resource *pOther =
+                dynamic_cast<const memory_resource *>(&other);
+
+        return (pOther != nullptr) && (pOther->handle_ == handle_);
+    }
+
+    mplite_t *handle_;
+};
+#endif /* #if MPLITE_HAVE_PMR */
+
+} /* namespace mplite */
+
+#endif /* #ifndef MPLITE_HPP */
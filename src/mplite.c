@@ -1,30 +1,118 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE    /* For sched_getcpu() */
+#endif /* #if defined(__linux__) && !defined(_GNU_SOURCE) */
+
 #include "mplite.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif /* #ifdef _WIN32 */
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif /* #ifdef __linux__ */
 
 /*
- ** A minimum allocation is an instance of the following structure.
- ** Larger allocations are an array of these structures where the
- ** size of the array is a power of 2.
- **
- ** The size of this object must be a power of two.  That fact is
- ** verified in mplite_init().
+ ** Smallest allocation size in bytes. Free blocks hold no bookkeeping of their
+ ** own but keeping atoms at least this large bounds the size of aCtrl[] and
+ ** the free block bitmaps relative to the pool, and leaves room for the
+ ** pointer that links a block into a mplite_tcache_t magazine.
  */
-typedef struct mplite_link mplite_link_t;
-
-struct mplite_link {
-    int next; /* Index of next free chunk */
-    int prev; /* Index of previous free chunk */
-};
+#define MPLITE_ATOM_MIN    8
 
 /*
  ** Masks used for mplite_t.aCtrl[] elements.
  */
-#define MPLITE_CTRL_LOGSIZE  0x1f    /* Log2 Size of this block */
-#define MPLITE_CTRL_FREE     0x20    /* True if not checked out */
+#define MPLITE_CTRL_LOGSIZE  0x3f    /* Log2 Size of this block */
+#define MPLITE_CTRL_FREE     0x40    /* True if not checked out */
+#define MPLITE_CTRL_SLAB     0x80    /* True if carved by a mplite_slab_t */
+#define MPLITE_CTRL_QUICK    0xc0    /* Free but on a quick list */
+
+/*
+ ** Header at the start of every slab of a mplite_slab_t. The slots follow the
+ ** bitmap, which has one bit per slot, set while the slot is free.
+ */
+typedef struct mplite_slab_page {
+    struct mplite_slab_page *pNext; /* Next slab of the class with free slots */
+    struct mplite_slab_page *pPrev; /* Previous slab of the class with free
+        slots */
+    int iClass; /* Size class of the slots */
+    int nFree; /* Number of free slots */
+    uint64_t aFree[1]; /* Free slot bitmap, sized for the class */
+} mplite_slab_page_t;
+
+/*
+ ** Magic number and layout version at the start of a pool file
+ */
+#define MPLITE_FILE_MAGIC      ((uint64_t) 0x4554494c504d4d50)    /* "PMMPLITE" */
+#define MPLITE_FILE_VERSION    1
+
+/*
+ ** Header of a pool file or shared memory segment. It records the geometry
+ ** of the pool and a copy of the state that mplite_t holds outside of the pool
+ ** memory itself. Everything else lives in the pool and refers to blocks by
+ ** index, so the file can be mapped at any address. The copy is current while
+ ** a file is detached and, in shared memory, whenever the lock is free.
+ */
+typedef struct mplite_file_header {
+    uint64_t magic; /* MPLITE_FILE_MAGIC */
+    uint32_t version; /* MPLITE_FILE_VERSION */
+    uint32_t bClean; /* True if the pool was detached cleanly */
+    uint32_t szInt; /* sizeof(mplite_int_t) of the creating build */
+    uint32_t nLogmax; /* MPLITE_LOGMAX of the creating build */
+    uint32_t bShared; /* True if the pool lives in shared memory */
+    uint32_t nRef; /* Number of processes attached to a shared pool */
+    int64_t nFile; /* Size of the file in bytes */
+    int64_t szAtom; /* mplite_t.szAtom */
+    int64_t nBlock; /* mplite_t.nBlock */
+    int64_t iMapOff; /* Offset in bytes of aMap from zPool */
+    int64_t iCtrlOff; /* Offset in bytes of aCtrl from zPool */
+    int64_t aiFreelist[MPLITE_LOGMAX + 1]; /* mplite_t.aiFreelist */
+    uint64_t mFreeOrders; /* mplite_t.mFreeOrders */
+    uint64_t nAlloc; /* Statistics of mplite_t */
+    uint64_t totalAlloc;
+    uint64_t totalExcess;
+    uint64_t currentOut;
+    uint64_t currentCount;
+    uint64_t maxOut;
+    uint64_t maxCount;
+    uint64_t maxRequest;
+#ifndef _WIN32
+    pthread_mutex_t mutex; /* Process-shared lock of a shared pool */
+#endif /* #ifndef _WIN32 */
+} mplite_file_header_t;
+
+/*
+ ** Saved state of a pool or region in the buffer of a mark. The buffer holds
+ ** one for the pool and then one for each of its regions, each followed by a
+ ** copy of the bitmaps and control bytes, from aMap to the end of aCtrl,
+ ** padded to 8 bytes. The quick lists are coalesced before saving, so there
+ ** are none to save.
+ */
+typedef struct mplite_save {
+    const mplite_t *pPool; /* Pool or region saved */
+    mplite_int_t nByte; /* Bytes of bitmaps and control bytes that follow */
+    int nRegion; /* Regions of the pool. Only set in the first one. */
+    mplite_int_t aiFreelist[MPLITE_LOGMAX + 1]; /* mplite_t.aiFreelist */
+    mplite_int_t anFreeBlock[MPLITE_LOGMAX + 1]; /* mplite_t.anFreeBlock */
+    mplite_mask_t mFreeOrders; /* mplite_t.mFreeOrders */
+    mplite_uint_t currentOut; /* mplite_t.currentOut */
+    mplite_uint_t currentCount; /* mplite_t.currentCount */
+} mplite_save_t;
 
 #ifdef _WIN32
 #define snprintf(buf, buf_size, format, ...) \
@@ -32,36 +120,423 @@ struct mplite_link {
 #endif /* #ifdef _WIN32 */
 
 /*
- ** Assuming mplite_t.zPool is divided up into an array of mplite_link_t
- ** structures, return a pointer to the idx-th such lik.
+ ** Count trailing and leading zero bits of a non-zero 32-bit value. The
+ ** compiler intrinsics map to a single instruction on all mainstream targets.
+ ** The portable fallbacks are branch-light binary searches.
+ */
+#if defined(__GNUC__)
+#define mplite_ctz32(x)    __builtin_ctz(x)
+#define mplite_clz32(x)    __builtin_clz(x)
+#define mplite_ctz64(x)    __builtin_ctzll(x)
+#define mplite_clz64(x)    __builtin_clzll(x)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#pragma intrinsic(_BitScanForward, _BitScanReverse)
+static __inline int mplite_ctz32(const uint32_t x)
+{
+    unsigned long r;
+    _BitScanForward(&r, x);
+    return (int) r;
+}
+static __inline int mplite_clz32(const uint32_t x)
+{
+    unsigned long r;
+    _BitScanReverse(&r, x);
+    return 31 - (int) r;
+}
+#else
+static int mplite_ctz32(uint32_t x)
+{
+    int n = 0;
+    assert(x != 0);
+    if ((x & 0xffff) == 0) { n += 16; x >>= 16; }
+    if ((x & 0xff) == 0) { n += 8; x >>= 8; }
+    if ((x & 0xf) == 0) { n += 4; x >>= 4; }
+    if ((x & 0x3) == 0) { n += 2; x >>= 2; }
+    if ((x & 0x1) == 0) { n += 1; }
+    return n;
+}
+static int mplite_clz32(uint32_t x)
+{
+    int n = 0;
+    assert(x != 0);
+    if ((x & 0xffff0000) == 0) { n += 16; x <<= 16; }
+    if ((x & 0xff000000) == 0) { n += 8; x <<= 8; }
+    if ((x & 0xf0000000) == 0) { n += 4; x <<= 4; }
+    if ((x & 0xc0000000) == 0) { n += 2; x <<= 2; }
+    if ((x & 0x80000000) == 0) { n += 1; }
+    return n;
+}
+#endif /* #if defined(__GNUC__) */
+
+/*
+ ** Thread-local storage and atomic increment. Without compiler support every
+ ** thread shares the same storage, which only costs balance, not correctness,
+ ** in the places these are used.
+ */
+#if defined(_MSC_VER)
+#define MPLITE_TLS    __declspec(thread)
+#define mplite_atomic_inc(p)    _InterlockedIncrement((volatile long *) (p))
+#elif defined(__GNUC__)
+#define MPLITE_TLS    __thread
+#define mplite_atomic_inc(p)    __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#else
+#define MPLITE_TLS
+#define mplite_atomic_inc(p)    (++*(p))
+#endif /* #if defined(_MSC_VER) */
+
+#ifndef mplite_ctz64
+#define mplite_ctz64(x)    (((uint32_t) (x) != 0) ?                   \
+        mplite_ctz32((uint32_t) (x)) : 32 + mplite_ctz32((uint32_t) ((x) >> 32)))
+#define mplite_clz64(x)    ((((x) >> 32) != 0) ?                      \
+        mplite_clz32((uint32_t) ((x) >> 32)) : 32 + mplite_clz32((uint32_t) (x)))
+#endif /* #ifndef mplite_ctz64 */
+
+/*
+ ** Bit scans and powers of two in the width of mplite_int_t and
+ ** mplite_mask_t.
+ */
+#ifdef MPLITE_64BIT
+#define MPLITE_INT_BITS    64
+#define mplite_ctz_int(x)    mplite_ctz64((uint64_t) (x))
+#define mplite_clz_int(x)    mplite_clz64((uint64_t) (x))
+#define mplite_ctz_mask(x)    mplite_ctz64(x)
+#define mplite_clz_mask(x)    mplite_clz64(x)
+#else
+#define MPLITE_INT_BITS    32
+#define mplite_ctz_int(x)    mplite_ctz32((uint32_t) (x))
+#define mplite_clz_int(x)    mplite_clz32((uint32_t) (x))
+#define mplite_ctz_mask(x)    mplite_ctz32(x)
+#define mplite_clz_mask(x)    mplite_clz32(x)
+#endif /* #ifdef MPLITE_64BIT */
+#define mplite_pow2(iLog)    ((mplite_int_t) 1 << (iLog))
+#define mplite_bit(iLog)    ((mplite_mask_t) 1 << (iLog))
+
+/*
+ ** Size in bytes of the smallest block and its log2, and the conversions
+ ** between block indices and addresses, which shift instead of dividing.
+ ** Building with MPLITE_ATOM_SIZE defined makes the size a compile-time
+ ** constant, so the shifts are by a constant as well, and only pools and
+ ** pool files of that atom size are accepted.
+ */
+#ifdef MPLITE_ATOM_SIZE
+#if (MPLITE_ATOM_SIZE < MPLITE_ATOM_MIN) || \
+    ((MPLITE_ATOM_SIZE & (MPLITE_ATOM_SIZE - 1)) != 0)
+#error "MPLITE_ATOM_SIZE must be a power of two of at least MPLITE_ATOM_MIN"
+#endif
+#define mplite_atom(handle)    ((void) (handle), (mplite_int_t) MPLITE_ATOM_SIZE)
+#define mplite_atom_valid(sz)    ((sz) == MPLITE_ATOM_SIZE)
+#else
+#define mplite_atom(handle)    ((handle)->szAtom)
+#define mplite_atom_valid(sz)    ((sz) >= MPLITE_ATOM_MIN)
+#endif /* #ifdef MPLITE_ATOM_SIZE */
+#define mplite_atom_log(handle)    mplite_ctz_int(mplite_atom(handle))
+#define mplite_index(handle, p)    ((mplite_int_t) (((const uint8_t *) (p) - \
+        (handle)->zPool) >> mplite_atom_log(handle)))
+#define mplite_block(handle, i)    \
+        (&(handle)->zPool[(mplite_int_t) (i) << mplite_atom_log(handle)])
+
+/*
+ ** Index of the word holding bit iBit of a bitmap level, counted from the
+ ** iLevel-th level above it. The shift can exceed the width of mplite_int_t
+ ** for the top level of a deep bitmap, so it is done in 64 bits.
+ */
+#define mplite_map_word(iBit, iLevel)    \
+        ((mplite_int_t) ((uint64_t) (iBit) >> (6 * ((iLevel) + 1))))
+
+/*
+ ** Atomic operations on the 32-bit words of the built-in locks and on the
+ ** statistics sequence number, and on the head pointers of the remote-free
+ ** queues. Acquiring operations have acquire semantics and stores have
+ ** release semantics, as does the pointer compare-and-swap that publishes a
+ ** queued block. The fences order plain accesses around them.
+ */
+#if defined(_MSC_VER)
+#define MPLITE_HAVE_ATOMICS    1
+#define mplite_atomic_load(p)    (*(p))
+#define mplite_atomic_store(p, v)    _InterlockedExchange((volatile long *) (p), (long) (v))
+#define mplite_atomic_xchg(p, v)    ((uint32_t) _InterlockedExchange((volatile long *) (p), (long) (v)))
+#define mplite_atomic_cas(p, o, n)    ((uint32_t) _InterlockedCompareExchange((volatile long *) (p), (long) (n), (long) (o)))
+#define mplite_atomic_add(p, v)    ((uint32_t) _InterlockedExchangeAdd((volatile long *) (p), (long) (v)))
+#define mplite_atomic_xchg_ptr(p, v)    _InterlockedExchangePointer((void * volatile *) (p), (v))
+#define mplite_atomic_cas_ptr(p, o, n)    _InterlockedCompareExchangePointer((void * volatile *) (p), (n), (o))
+#define mplite_pause()    YieldProcessor()
+#define mplite_yield()    SwitchToThread()
+#if defined(_M_IX86) || defined(_M_X64)
+#define mplite_fence_acquire()    _ReadWriteBarrier()
+#define mplite_fence_release()    _ReadWriteBarrier()
+#else
+#define mplite_fence_acquire()    MemoryBarrier()
+#define mplite_fence_release()    MemoryBarrier()
+#endif /* #if defined(_M_IX86) || defined(_M_X64) */
+#elif defined(__GNUC__)
+#define MPLITE_HAVE_ATOMICS    1
+#define mplite_atomic_load(p)    __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define mplite_atomic_store(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define mplite_atomic_xchg(p, v)    __atomic_exchange_n((p), (v), __ATOMIC_ACQUIRE)
+#define mplite_atomic_cas(p, o, n)    mplite_gcc_cas((p), (o), (n))
+#define mplite_atomic_add(p, v)    __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#define mplite_atomic_xchg_ptr(p, v)    __atomic_exchange_n((p), (v), __ATOMIC_ACQUIRE)
+#define mplite_atomic_cas_ptr(p, o, n)    mplite_gcc_cas_ptr((p), (o), (n))
+#if defined(__i386__) || defined(__x86_64__)
+#define mplite_pause()    __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define mplite_pause()    __asm__ __volatile__("yield" ::: "memory")
+#else
+#define mplite_pause()    __asm__ __volatile__("" ::: "memory")
+#endif /* #if defined(__i386__) || defined(__x86_64__) */
+#define mplite_yield()    sched_yield()
+#define mplite_fence_acquire()    __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define mplite_fence_release()    __atomic_thread_fence(__ATOMIC_RELEASE)
+static __inline uint32_t mplite_gcc_cas(volatile uint32_t *p, uint32_t o,
+                                        const uint32_t n)
+{
+    __atomic_compare_exchange_n(p, &o, n, 0, __ATOMIC_ACQUIRE,
+                                __ATOMIC_RELAXED);
+    return o;
+}
+static __inline void *mplite_gcc_cas_ptr(void * volatile *p, void *o,
+                                         void * const n)
+{
+    __atomic_compare_exchange_n(p, &o, n, 0, __ATOMIC_RELEASE,
+                                __ATOMIC_RELAXED);
+    return o;
+}
+#else
+#define MPLITE_HAVE_ATOMICS    0
+#endif /* #if defined(_MSC_VER) */
+
+/*
+ ** True if the remote-free queue of a pool holds blocks. Other threads push
+ ** onto it without the lock, and the owner of a pool may have no lock at
+ ** all, so the head is read atomically.
+ */
+#if MPLITE_HAVE_ATOMICS
+#define mplite_remote_pending(handle)    \
+        (mplite_atomic_load(&(handle)->pRemote) != NULL)
+#else
+#define mplite_remote_pending(handle)    ((handle)->pRemote != NULL)
+#endif /* #if MPLITE_HAVE_ATOMICS */
+
+/*
+ ** Built-in lock policies, numbered as the sentinel lock pointers of
+ ** mplite.h, and the number of pause instructions a waiter spins through
+ ** before it starts yielding the CPU.
+ */
+#define MPLITE_POLICY_CALLBACK    0
+#define MPLITE_POLICY_SPIN        1
+#define MPLITE_POLICY_FUTEX       2
+#define MPLITE_POLICY_TICKET      3
+#define MPLITE_SPIN_MAX           1024
+
+#define mplite_lock_builtin(lock)    (((uintptr_t) (lock) >=            \
+        MPLITE_POLICY_SPIN) && ((uintptr_t) (lock) <= MPLITE_POLICY_TICKET))
+
+static uint64_t mplite_clock(void);
+#if MPLITE_HAVE_ATOMICS
+static void mplite_backoff(int *pnSpin);
+static void mplite_spin_wait(volatile uint32_t *aWord);
+static void mplite_futex_wait(volatile uint32_t *aWord);
+static void mplite_futex_wake(volatile uint32_t *aWord);
+static void mplite_ticket_wait(volatile uint32_t *aWord,
+                               const uint32_t iTicket);
+
+/*
+ ** Acquire and release the lock of a pool. The uncontended path of the
+ ** built-in locks is a single atomic operation inlined at the call site.
+ ** Waiting is left to out of line functions.
+ **
+ ** The statistics sequence number is odd for as long as the lock is held.
+ ** Only the holder writes it, so plain increments are enough. A built-in
+ ** lock that had to wait reads the clock around the wait, so the
+ ** uncontended path never does.
  */
-#define mplite_getlink(handle, idx) ((mplite_link_t *)    \
-        (&handle->zPool[(idx) * handle->szAtom]))
+static __inline void mplite_enter(mplite_t *handle)
+{
+    volatile uint32_t *aWord = handle->aLockWord;
+    uint64_t iWait = 0; /* Start of the wait, or zero if there was none */
+    uint32_t iTicket;
+
+    switch (handle->lockPolicy) {
+    case MPLITE_POLICY_SPIN:
+        if (mplite_atomic_xchg(&aWord[0], 1) != 0) {
+            iWait = mplite_clock();
+            mplite_spin_wait(aWord);
+        }
+        break;
+    case MPLITE_POLICY_FUTEX:
+        if (mplite_atomic_cas(&aWord[0], 0, 1) != 0) {
+            iWait = mplite_clock();
+            mplite_futex_wait(aWord);
+        }
+        break;
+    case MPLITE_POLICY_TICKET:
+        iTicket = mplite_atomic_add(&aWord[0], 1);
+        if (mplite_atomic_load(&aWord[1]) != iTicket) {
+            iWait = mplite_clock();
+            mplite_ticket_wait(aWord, iTicket);
+        }
+        break;
+    default:
+        if (handle->lock.acquire != NULL) {
+            handle->lock.acquire(handle->lock.arg);
+        }
+        break;
+    }
+    handle->nStatSeq++;
+    mplite_fence_release();
+    handle->nLockAcquire++;
+    if (iWait != 0) {
+        handle->nLockContended++;
+        handle->nLockWaitNs += mplite_clock() - iWait;
+    }
+}
+
+static __inline void mplite_leave(mplite_t *handle)
+{
+    volatile uint32_t *aWord = handle->aLockWord;
+
+    mplite_atomic_store(&handle->nStatSeq, handle->nStatSeq + 1);
+    switch (handle->lockPolicy) {
+    case MPLITE_POLICY_SPIN:
+        mplite_atomic_store(&aWord[0], 0);
+        break;
+    case MPLITE_POLICY_FUTEX:
+        if (mplite_atomic_add(&aWord[0], (uint32_t) -1) != 1) {
+            mplite_futex_wake(aWord);
+        }
+        break;
+    case MPLITE_POLICY_TICKET:
+        /* Only the holder writes the owner ticket */
+        mplite_atomic_store(&aWord[1], aWord[1] + 1);
+        break;
+    default:
+        if (handle->lock.release != NULL) {
+            handle->lock.release(handle->lock.arg);
+        }
+        break;
+    }
+}
 
+/* Thread-local byte whose address identifies the calling thread */
+static MPLITE_TLS char mplite_thread_tag;
+
+/* True if the pool has an owner other than the calling thread, whose frees
+ * must then go through the remote-free queue
+ */
+#define mplite_remote_caller(handle)    (((handle)->pOwner != NULL) && \
+        ((handle)->pOwner != &mplite_thread_tag))
+#else
 #define mplite_enter(handle)    if((handle != NULL) &&        \
         ((handle)->lock.acquire != NULL))                    \
         { (handle)->lock.acquire((handle)->lock.arg); }
 #define mplite_leave(handle)    if((handle != NULL) &&        \
         ((handle)->lock.release != NULL))                    \
         { (handle)->lock.release((handle)->lock.arg); }
-
-static int mplite_logarithm(const int iValue);
-static int mplite_size(const mplite_t *handle, const void *p);
-static void mplite_link(mplite_t *handle, const int i, const int iLogsize);
-static void mplite_unlink(mplite_t *handle, const int i, const int iLogsize);
-static int mplite_unlink_first(mplite_t *handle, const int iLogsize);
-static void *mplite_malloc_unsafe(mplite_t *handle, const int nByte);
+#endif /* #if MPLITE_HAVE_ATOMICS */
+
+static int mplite_lock_setup(mplite_t *handle, const mplite_lock_t *lock);
+static int mplite_logarithm(const mplite_int_t iValue);
+static int mplite_order(const mplite_t *handle, const mplite_int_t nByte);
+static mplite_int_t mplite_size(const mplite_t *handle, const void *p);
+static mplite_int_t mplite_map_layout(mplite_t *handle,
+                                      const mplite_int_t nBlock);
+static void mplite_format(mplite_t *handle);
+static mplite_int_t mplite_save_size(const mplite_t *handle);
+static void mplite_map_set(mplite_t *handle, const int iLogsize,
+                           const mplite_int_t iBit);
+static void mplite_map_clear(mplite_t *handle, const int iLogsize,
+                             mplite_int_t iBit);
+static mplite_int_t mplite_map_first(const mplite_t *handle,
+                                     const int iLogsize);
+static void mplite_link(mplite_t *handle, const mplite_int_t i,
+                        const int iLogsize);
+static void mplite_unlink(mplite_t *handle, const mplite_int_t i,
+                          const int iLogsize);
+static mplite_int_t mplite_unlink_first(mplite_t *handle, const int iLogsize);
+static mplite_mask_t mplite_avail(mplite_t *handle, const int iLogsize);
+static void *mplite_malloc_unsafe(mplite_t *handle, const mplite_int_t nByte);
+static int mplite_malloc_batch_unsafe(mplite_t *handle,
+                                      const mplite_int_t nByte,
+                                      const int nCount, void **apOut);
+static void *mplite_memalign_unsafe(mplite_t *handle,
+                                    const mplite_int_t nAlign,
+                                    const mplite_int_t nByte);
+static void mplite_count_alloc(mplite_t *handle, const mplite_int_t nByte,
+                               const int iLogsize, const int nCount);
+static void mplite_peak(mplite_t *handle);
+static void mplite_count_carve(mplite_t *handle, const int iBin,
+                               const int iLogsize, const mplite_int_t nCarve);
 static void mplite_free_unsafe(mplite_t *handle, const void *pOld);
+static void mplite_merge(mplite_t *handle, mplite_int_t iBlock, int iLogsize);
+static void mplite_quick_push(mplite_t *handle, const mplite_int_t iBlock,
+                              const int iLogsize);
+static mplite_int_t mplite_quick_pop(mplite_t *handle, const int iLogsize);
+static void mplite_quick_drain(mplite_t *handle, const int iLogsize);
+static void mplite_quick_flush(mplite_t *handle);
+static int mplite_remote_setup(mplite_t *handle, const int nThreshold,
+                               const void *pOwner);
+#if MPLITE_HAVE_ATOMICS
+static void mplite_remote_push(mplite_t *handle, const void *p);
+#endif /* #if MPLITE_HAVE_ATOMICS */
+static void mplite_remote_drain(mplite_t *handle);
+static mplite_t *mplite_region(const mplite_t *handle, const void *p);
+static void *mplite_region_alloc(mplite_t *handle, const mplite_int_t nAlign,
+                                 const mplite_int_t nByte);
+static int mplite_resize_unsafe(mplite_t *handle, const void *p,
+                                const int iNewLog);
+static int mplite_set_home(const mplite_set_t *set);
+static mplite_int_t mplite_map_count(const mplite_t *handle,
+                                     const int iLogsize, const int iLevel,
+                                     const mplite_int_t iWord);
+static void mplite_count_free(mplite_t *handle);
+static void mplite_map_repair(mplite_t *handle, const int iLogsize,
+                              const int iLevel, const mplite_int_t iWord);
+static int mplite_map_test(const mplite_t *handle, const int iLogsize,
+                           const mplite_int_t iBit);
+static void mplite_trace_add(mplite_t *handle, const mplite_int_t nSize,
+                             const void *pOld, const void *pNew);
+static void mplite_stats_copy(const mplite_t *handle, mplite_stats_t *stats);
+static int mplite_export_append(char *buf, const int buf_size, int *pnOut,
+                                const char *zLine);
+static void *mplite_tcache_refill(mplite_tcache_t *cache, const int iLogsize);
+static void mplite_tcache_drain(mplite_tcache_t *cache, const int iLogsize,
+                                int nDrain);
+static int mplite_slab_class(const mplite_slab_t *slab,
+                             const mplite_int_t nByte);
+static void *mplite_slab_get(mplite_slab_t *slab, const int iClass);
+static void mplite_slab_put(mplite_slab_t *slab, mplite_slab_page_t *pPage,
+                            const void *p);
+static int mplite_file_create(mplite_t *handle, const char *path,
+                              const int bShared, const mplite_int_t nFile,
+                              const int min_alloc, const mplite_lock_t *lock);
+static int mplite_file_open(mplite_t *handle, const char *path,
+                            const int bShared);
+static void mplite_file_load(mplite_t *handle,
+                             const mplite_file_header_t *pHdr);
+static void mplite_file_save(const mplite_t *handle,
+                             mplite_file_header_t *pHdr);
+static void mplite_file_recover(mplite_t *handle);
+static int mplite_shm_acquire(void *arg);
+static int mplite_shm_release(void *arg);
+static void *mplite_file_map(const char *path, const int bShared,
+                             const int bCreate, mplite_int_t *pnMap);
+static int mplite_file_sync(void *pMap, const mplite_int_t nByte);
+static void mplite_file_unmap(void *pMap, const mplite_int_t nByte);
 
 MPLITE_API int mplite_init(mplite_t *handle, const void *buf,
-                           const int buf_size, const int min_alloc,
+                           const mplite_int_t buf_size, const int min_alloc,
                            const mplite_lock_t *lock)
 {
-    int ii; /* Loop counter */
-    int nByte; /* Number of bytes of memory available to this allocator */
+    mplite_int_t nByte; /* Number of bytes of memory available to this
+        allocator */
     uint8_t *zByte; /* Memory usable by this allocator */
     int nMinLog; /* Log base 2 of minimum allocation size in bytes */
-    int iOffset; /* An offset into handle->aCtrl[] */
+    mplite_int_t nWord; /* Number of 64-bit words in the free block bitmaps */
+    mplite_int_t nDiv; /* Bytes taken by four blocks and their bookkeeping */
+    int nPad; /* Bytes skipped to align the free block bitmaps */
+    mplite_int_t nAlign; /* Alignment given to the start of the pool */
+    mplite_int_t nSkip; /* Bytes skipped to align the start of the pool */
 
     /* Check the parameters */
     if ((NULL == handle) || (NULL == buf) || (buf_size <= 0) ||
@@ -72,48 +547,69 @@ MPLITE_API int mplite_init(mplite_t *handle, const void *buf,
     /* Initialize the mplite_t object */
     memset(handle, 0, sizeof (*handle));
 
-    /* Copy the lock if it is not NULL */
-    if (lock != NULL) {
-        memcpy(&handle->lock, lock, sizeof (handle->lock));
+    /* Select a built-in lock or copy the lock if it is not NULL */
+    if (mplite_lock_setup(handle, lock) != MPLITE_OK) {
+        return MPLITE_ERR_INVPAR;
     }
 
-    /* The size of a mplite_link_t object must be a power of two.  Verify that
-     ** this is case.
+    /* Realign the start of the pool so that blocks are aligned in absolute
+     ** terms and not only relative to the buffer. Settle for a smaller
+     ** alignment if the padding would cost more than 1/64 of the buffer.
      */
-    assert((sizeof (mplite_link_t)&(sizeof (mplite_link_t) - 1)) == 0);
-
-    nByte = buf_size;
-    zByte = (uint8_t*) buf;
+    for (nAlign = MPLITE_POOL_ALIGN; nAlign > MPLITE_ATOM_MIN; nAlign >>= 1) {
+        if ((mplite_int_t) ((0 - (uintptr_t) buf) & (nAlign - 1)) <=
+            buf_size / 64) {
+            break;
+        }
+    }
+    nSkip = (mplite_int_t) ((0 - (uintptr_t) buf) & (nAlign - 1));
+    if (nSkip >= buf_size) {
+        return MPLITE_ERR_INVPAR;
+    }
+    nByte = buf_size - nSkip;
+    zByte = (uint8_t*) buf + nSkip;
 
     nMinLog = mplite_logarithm(min_alloc);
-    handle->szAtom = (1 << nMinLog);
-    while ((int) sizeof (mplite_link_t) > handle->szAtom) {
-        handle->szAtom = handle->szAtom << 1;
+    handle->szAtom = mplite_pow2(nMinLog);
+    if (handle->szAtom < MPLITE_ATOM_MIN) {
+        handle->szAtom = MPLITE_ATOM_MIN;
     }
-
-    handle->nBlock = (nByte / (handle->szAtom + sizeof (uint8_t)));
-    handle->zPool = zByte;
-    handle->aCtrl = (uint8_t *) & handle->zPool[handle->nBlock * handle->szAtom];
-
-    for (ii = 0; ii <= MPLITE_LOGMAX; ii++) {
-        handle->aiFreelist[ii] = -1;
+#ifdef MPLITE_ATOM_SIZE
+    /* The atom size is fixed at build time */
+    if (handle->szAtom > MPLITE_ATOM_SIZE) {
+        return MPLITE_ERR_INVPAR;
     }
+    handle->szAtom = MPLITE_ATOM_SIZE;
+#endif /* #ifdef MPLITE_ATOM_SIZE */
 
-    iOffset = 0;
-    for (ii = MPLITE_LOGMAX; ii >= 0; ii--) {
-        int nAlloc = (1 << ii);
-        if ((iOffset + nAlloc) <= handle->nBlock) {
-            handle->aCtrl[iOffset] = (uint8_t) (ii | MPLITE_CTRL_FREE);
-            mplite_link(handle, iOffset, ii);
-            iOffset += nAlloc;
+    /* Split the buffer into the blocks, the free block bitmaps and aCtrl[].
+     ** The bitmaps take about a quarter of a byte per block on top of the
+     ** byte in aCtrl[]. Start from that estimate and drop blocks until the
+     ** rounding of every bitmap level and the alignment padding also fit.
+     */
+    nDiv = handle->szAtom * 4 + 5;
+    handle->nBlock = (nByte / nDiv) * 4 + ((nByte % nDiv) * 4) / nDiv;
+    for (;;) {
+        nWord = mplite_map_layout(handle, handle->nBlock);
+        nPad = (int) ((0 - (uintptr_t) (zByte + handle->nBlock *
+                handle->szAtom)) & (sizeof (uint64_t) - 1));
+        if ((handle->nBlock * (handle->szAtom + 1) + nPad +
+            nWord * (mplite_int_t) sizeof (uint64_t)) <= nByte) {
+            break;
         }
-        assert((iOffset + nAlloc) > handle->nBlock);
+        handle->nBlock--;
     }
+    handle->zPool = zByte;
+    handle->aMap = (uint64_t *) & handle->zPool[handle->nBlock * handle->szAtom +
+            nPad];
+    handle->aCtrl = (uint8_t *) & handle->aMap[nWord];
+
+    mplite_format(handle);
 
     return MPLITE_OK;
 }
 
-MPLITE_API void *mplite_malloc(mplite_t *handle, const int nBytes)
+MPLITE_API void *mplite_malloc(mplite_t *handle, const mplite_int_t nBytes)
 {
     int64_t *p = 0;
 
@@ -124,11 +620,33 @@ MPLITE_API void *mplite_malloc(mplite_t *handle, const int nBytes)
 
     mplite_enter(handle);
     p = mplite_malloc_unsafe(handle, nBytes);
+    if (handle->pTrace != NULL) {
+        mplite_trace_add(handle, nBytes, NULL, p);
+    }
     mplite_leave(handle);
 
     return (void*) p;
 }
 
+MPLITE_API void *mplite_memalign(mplite_t *handle,
+                                 const mplite_int_t alignment,
+                                 const mplite_int_t nBytes)
+{
+    void *p;
+
+    /* Check the parameters */
+    if ((NULL == handle) || (alignment <= 0) ||
+        ((alignment & (alignment - 1)) != 0) || (nBytes <= 0)) {
+        return NULL;
+    }
+
+    mplite_enter(handle);
+    p = mplite_memalign_unsafe(handle, alignment, nBytes);
+    mplite_leave(handle);
+
+    return p;
+}
+
 MPLITE_API void mplite_free(mplite_t *handle, const void *pPrior)
 {
     /* Check the parameters */
@@ -136,15 +654,91 @@ MPLITE_API void mplite_free(mplite_t *handle, const void *pPrior)
         return;
     }
 
+#if MPLITE_HAVE_ATOMICS
+    /* Leave the block to the owner of the pool, if there is one */
+    if (mplite_remote_caller(handle)) {
+        mplite_remote_push(handle, pPrior);
+        return;
+    }
+#endif /* #if MPLITE_HAVE_ATOMICS */
+
     mplite_enter(handle);
+    if (handle->pTrace != NULL) {
+        mplite_trace_add(handle, 0, pPrior, NULL);
+    }
     mplite_free_unsafe(handle, pPrior);
+#if MPLITE_HAVE_ATOMICS
+    /* The owner drains its queue once other threads filled it up */
+    if ((handle->nRemoteMax > 0) &&
+        (mplite_atomic_load(&handle->nRemote) >= handle->nRemoteMax)) {
+        mplite_remote_drain(handle);
+    }
+#endif /* #if MPLITE_HAVE_ATOMICS */
+    mplite_leave(handle);
+}
+
+MPLITE_API int mplite_malloc_batch(mplite_t *handle,
+                                   const mplite_int_t nBytes,
+                                   const int nCount, void **apOut)
+{
+    int n;
+
+    /* Check the parameters */
+    if ((NULL == handle) || (nBytes <= 0) || (nCount <= 0) ||
+        (NULL == apOut)) {
+        return 0;
+    }
+
+    mplite_enter(handle);
+    n = mplite_malloc_batch_unsafe(handle, nBytes, nCount, apOut);
+    mplite_leave(handle);
+
+    if (n < nCount) {
+        memset(&apOut[n], 0, (nCount - n) * sizeof (apOut[0]));
+    }
+    return n;
+}
+
+MPLITE_API int mplite_free_batch(mplite_t *handle, void * const *apPrior,
+                                 const int nCount)
+{
+    int n = 0;
+    int ii;
+
+    /* Check the parameters */
+    if ((NULL == handle) || (NULL == apPrior) || (nCount <= 0)) {
+        return 0;
+    }
+
+#if MPLITE_HAVE_ATOMICS
+    /* Leave the blocks to the owner of the pool, if there is one */
+    if (mplite_remote_caller(handle)) {
+        for (ii = 0; ii < nCount; ii++) {
+            if (apPrior[ii] != NULL) {
+                mplite_remote_push(handle, apPrior[ii]);
+                n++;
+            }
+        }
+        return n;
+    }
+#endif /* #if MPLITE_HAVE_ATOMICS */
+
+    mplite_enter(handle);
+    for (ii = 0; ii < nCount; ii++) {
+        if (apPrior[ii] != NULL) {
+            mplite_free_unsafe(handle, apPrior[ii]);
+            n++;
+        }
+    }
     mplite_leave(handle);
+
+    return n;
 }
 
 MPLITE_API void *mplite_realloc(mplite_t *handle, const void *pPrior,
-                                const int nBytes)
+                                const mplite_int_t nBytes)
 {
-    int nOld;
+    mplite_int_t nOld;
     void *p;
 
     /* Check the parameters */
@@ -153,303 +747,3168 @@ MPLITE_API void *mplite_realloc(mplite_t *handle, const void *pPrior,
         return NULL;
     }
 
-    nOld = mplite_size(handle, pPrior);
-    if (nBytes <= nOld) {
+    /* Resize in place or reserve the new block */
+    mplite_enter(handle);
+    if (mplite_resize_unsafe(handle, pPrior, mplite_order(handle, nBytes))) {
+        if (handle->pTrace != NULL) {
+            mplite_trace_add(handle, nBytes, pPrior, pPrior);
+        }
+        mplite_leave(handle);
         return (void *) pPrior;
     }
-    mplite_enter(handle);
+    nOld = mplite_size(handle, pPrior);
     p = mplite_malloc_unsafe(handle, nBytes);
-    if (p) {
-        memcpy(p, pPrior, nOld);
-        mplite_free_unsafe(handle, pPrior);
+    if (handle->pTrace != NULL) {
+        mplite_trace_add(handle, nBytes, pPrior, p);
+    }
+    mplite_leave(handle);
+    if (NULL == p) {
+        return NULL;
     }
+
+    /* Both blocks are checked out and belong to the caller, so the copy does
+     ** not need the lock. Other threads keep allocating and freeing while a
+     ** large block is being copied.
+     */
+    memcpy(p, pPrior, nOld);
+
+    /* Give back the old block */
+    mplite_enter(handle);
+    mplite_free_unsafe(handle, pPrior);
     mplite_leave(handle);
 
     return p;
 }
 
-MPLITE_API int mplite_roundup(mplite_t *handle, const int n)
+MPLITE_API mplite_int_t mplite_roundup(mplite_t *handle,
+                                       const mplite_int_t n)
 {
-    int iFullSz;
-
     /* Check the parameters */
     if ((NULL == handle) || (n > MPLITE_MAX_ALLOC_SIZE)) {
         return 0;
     }
 
-    for (iFullSz = handle->szAtom; iFullSz < n; iFullSz *= 2);
-
-    return iFullSz;
+    return mplite_atom(handle) << mplite_order(handle, n);
 }
 
 MPLITE_API void mplite_print_stats(const mplite_t * const handle,
                                    const mplite_putsfunc_t putsfunc)
 {
     if ((handle != NULL) && (putsfunc != NULL)) {
+        mplite_stats_t stats; /* Totals of the pool and its regions */
         char zStats[256];
-        snprintf(zStats, sizeof (zStats), "Total number of calls to malloc: %u",
-                (unsigned) handle->nAlloc);
+
+        mplite_stats_copy(handle, &stats);
+        snprintf(zStats, sizeof (zStats), "Total number of calls to malloc: "
+                "%llu", (unsigned long long) stats.nAlloc);
         putsfunc(zStats);
 
         snprintf(zStats, sizeof (zStats), "Total of all malloc calls - includes "
-                "internal fragmentation: %u", (unsigned) handle->totalAlloc);
+                "internal fragmentation: %llu",
+                (unsigned long long) stats.totalAlloc);
         putsfunc(zStats);
 
-        snprintf(zStats, sizeof (zStats), "Total internal fragmentation: %u",
-                (unsigned) handle->totalExcess);
+        snprintf(zStats, sizeof (zStats), "Total internal fragmentation: %llu",
+                (unsigned long long) stats.totalExcess);
         putsfunc(zStats);
 
         snprintf(zStats, sizeof (zStats), "Current checkout, including internal "
-                "fragmentation: %u", handle->currentOut);
+                "fragmentation: %llu", (unsigned long long) stats.currentOut);
         putsfunc(zStats);
 
-        snprintf(zStats, sizeof (zStats), "Current number of distinct checkouts: %u",
-                handle->currentCount);
+        snprintf(zStats, sizeof (zStats), "Current number of distinct checkouts: "
+                "%llu", (unsigned long long) stats.currentCount);
         putsfunc(zStats);
 
-        snprintf(zStats, sizeof (zStats), "Maximum instantaneous currentOut: %u",
-                handle->maxOut);
+        snprintf(zStats, sizeof (zStats), "Maximum instantaneous currentOut: "
+                "%llu", (unsigned long long) stats.maxOut);
         putsfunc(zStats);
 
-        snprintf(zStats, sizeof (zStats), "Maximum instantaneous currentCount: %u",
-                handle->maxCount);
+        snprintf(zStats, sizeof (zStats), "Maximum instantaneous currentCount: "
+                "%llu", (unsigned long long) stats.maxCount);
         putsfunc(zStats);
 
         snprintf(zStats, sizeof (zStats), "Largest allocation (exclusive of "
-                "internal frag): %u", handle->maxRequest);
+                "internal frag): %llu", (unsigned long long) stats.maxRequest);
+        putsfunc(zStats);
+
+        snprintf(zStats, sizeof (zStats), "Failed allocation requests: %llu",
+                (unsigned long long) stats.nFail);
+        putsfunc(zStats);
+
+        snprintf(zStats, sizeof (zStats), "Lock acquisitions: %llu",
+                (unsigned long long) stats.nLockAcquire);
+        putsfunc(zStats);
+
+        snprintf(zStats, sizeof (zStats), "Contended lock acquisitions: %llu",
+                (unsigned long long) stats.nLockContended);
+        putsfunc(zStats);
+
+        snprintf(zStats, sizeof (zStats), "Lock wait time in ns: %llu",
+                (unsigned long long) stats.nLockWaitNs);
         putsfunc(zStats);
     }
 }
 
-/*
- ** Return the ceiling of the logarithm base 2 of iValue.
- **
- ** Examples:   mplite_logarithm(1) -> 0
- **             mplite_logarithm(2) -> 1
- **             mplite_logarithm(4) -> 2
- **             mplite_logarithm(5) -> 3
- **             mplite_logarithm(8) -> 3
- **             mplite_logarithm(9) -> 4
- */
-static int mplite_logarithm(const int iValue)
+MPLITE_API int mplite_get_stats(mplite_t *handle, mplite_stats_t *stats)
 {
-    int iLog;
-    for (iLog = 0; (1 << iLog) < iValue; iLog++);
-    return iLog;
-}
+#if MPLITE_HAVE_ATOMICS
+    int nSpin = 1;
+#endif /* #if MPLITE_HAVE_ATOMICS */
 
-/*
- ** Return the size of an outstanding allocation, in bytes.  The
- ** size returned omits the 8-byte header overhead.  This only
- ** works for chunks that are currently checked out.
- */
-static int mplite_size(const mplite_t *handle, const void *p)
-{
-    int iSize = 0;
-    if (p) {
-        int i = ((uint8_t *) p - handle->zPool) / handle->szAtom;
-        assert(i >= 0 && i < handle->nBlock);
-        iSize = handle->szAtom *
-                (1 << (handle->aCtrl[i] & MPLITE_CTRL_LOGSIZE));
+    /* Check the parameters */
+    if ((NULL == handle) || (NULL == stats)) {
+        return MPLITE_ERR_INVPAR;
     }
-    return iSize;
-}
 
-/*
- ** Link the chunk at handle->aPool[i] so that is on the iLogsize
- ** free list.
- */
-static void mplite_link(mplite_t *handle, const int i, const int iLogsize)
-{
-    int x;
-    assert(i >= 0 && i < handle->nBlock);
-    assert(iLogsize >= 0 && iLogsize <= MPLITE_LOGMAX);
-    assert((handle->aCtrl[i] & MPLITE_CTRL_LOGSIZE) == iLogsize);
+#if MPLITE_HAVE_ATOMICS
+    /* Copy the statistics until the copy did not overlap an update. Other
+     ** processes update a shared pool behind the back of this handle, so its
+     ** statistics are only current under the lock.
+     */
+    while (handle->lock.acquire != mplite_shm_acquire) {
+        uint32_t iSeq = mplite_atomic_load(&handle->nStatSeq);
+        if ((iSeq & 1) == 0) {
+            mplite_stats_copy(handle, stats);
+            mplite_fence_acquire();
+            if (mplite_atomic_load(&handle->nStatSeq) == iSeq) {
+                return MPLITE_OK;
+            }
+        }
+        mplite_backoff(&nSpin);
+    }
+#endif /* #if MPLITE_HAVE_ATOMICS */
 
-    x = mplite_getlink(handle, i)->next = handle->aiFreelist[iLogsize];
-    mplite_getlink(handle, i)->prev = -1;
-    if (x >= 0) {
-        assert(x < handle->nBlock);
-        mplite_getlink(handle, x)->prev = i;
+    mplite_enter(handle);
+    if (handle->lock.acquire == mplite_shm_acquire) {
+        mplite_count_free(handle);
     }
-    handle->aiFreelist[iLogsize] = i;
+    mplite_stats_copy(handle, stats);
+    mplite_leave(handle);
+
+    return MPLITE_OK;
 }
 
-/*
- ** Unlink the chunk at handle->aPool[i] from list it is currently
- ** on.  It should be found on handle->aiFreelist[iLogsize].
- */
-static void mplite_unlink(mplite_t *handle, const int i, const int iLogsize)
+MPLITE_API int mplite_export_stats(const mplite_stats_t *stats,
+                                   const char *name, char *buf,
+                                   const int buf_size)
 {
-    int next, prev;
-    assert(i >= 0 && i < handle->nBlock);
-    assert(iLogsize >= 0 && iLogsize <= MPLITE_LOGMAX);
-    assert((handle->aCtrl[i] & MPLITE_CTRL_LOGSIZE) == iLogsize);
+    /* Pool-wide metrics and the offset of their value in mplite_stats_t */
+    static const struct {
+        const char *zName;
+        const char *zType;
+        const char *zHelp;
+        size_t iOffset;
+    } aTotal[] = {
+        {"mplite_pool_bytes", "gauge", "Bytes of memory available for "
+            "allocation", offsetof(mplite_stats_t, nPoolBytes)},
+        {"mplite_allocations_total", "counter", "Successful allocations",
+            offsetof(mplite_stats_t, nAlloc)},
+        {"mplite_failed_allocations_total", "counter", "Allocation requests "
+            "that failed", offsetof(mplite_stats_t, nFail)},
+        {"mplite_allocated_bytes_total", "counter", "Bytes allocated, "
+            "including internal fragmentation",
+            offsetof(mplite_stats_t, totalAlloc)},
+        {"mplite_excess_bytes_total", "counter", "Bytes of internal "
+            "fragmentation", offsetof(mplite_stats_t, totalExcess)},
+        {"mplite_checked_out_bytes", "gauge", "Bytes checked out, including "
+            "internal fragmentation", offsetof(mplite_stats_t, currentOut)},
+        {"mplite_checked_out_allocations", "gauge", "Allocations checked "
+            "out", offsetof(mplite_stats_t, currentCount)},
+        {"mplite_checked_out_bytes_max", "gauge", "Maximum of "
+            "mplite_checked_out_bytes", offsetof(mplite_stats_t, maxOut)},
+        {"mplite_checked_out_allocations_max", "gauge", "Maximum of "
+            "mplite_checked_out_allocations",
+            offsetof(mplite_stats_t, maxCount)},
+        {"mplite_request_bytes_max", "gauge", "Largest allocation request",
+            offsetof(mplite_stats_t, maxRequest)},
+        {"mplite_lock_acquisitions_total", "counter", "Acquisitions of the "
+            "pool lock", offsetof(mplite_stats_t, nLockAcquire)},
+        {"mplite_lock_contended_total", "counter", "Acquisitions of a "
+            "built-in pool lock that had to wait",
+            offsetof(mplite_stats_t, nLockContended)},
+        {"mplite_lock_wait_nanoseconds_total", "counter", "Time spent waiting "
+            "for a built-in pool lock",
+            offsetof(mplite_stats_t, nLockWaitNs)}
+    };
+    /* Per-order metrics and the offset of their array in mplite_stats_t */
+    static const struct {
+        const char *zName;
+        const char *zType;
+        const char *zHelp;
+        size_t iOffset;
+    } aOrder[] = {
+        {"mplite_order_allocations_total", "counter", "Allocations of each "
+            "block order", offsetof(mplite_stats_t, anAlloc)},
+        {"mplite_order_frees_total", "counter", "Frees of each block order",
+            offsetof(mplite_stats_t, anFree)},
+        {"mplite_order_splits_total", "counter", "Blocks of each order split "
+            "in halves", offsetof(mplite_stats_t, anSplit)},
+        {"mplite_order_coalesces_total", "counter", "Blocks of each order "
+            "formed by merging free buddies",
+            offsetof(mplite_stats_t, anCoalesce)},
+        {"mplite_order_free_blocks", "gauge", "Free blocks of each order",
+            offsetof(mplite_stats_t, anFreeBlock)}
+    };
+    char zLabel[128]; /* Escaped pool name */
+    char zLine[512];
+    int nOut = 0;
+    int ii, jj;
 
-    next = mplite_getlink(handle, i)->next;
-    prev = mplite_getlink(handle, i)->prev;
-    if (prev < 0) {
-        handle->aiFreelist[iLogsize] = next;
+    /* Check the parameters */
+    if ((NULL == stats) || (NULL == name) || (NULL == buf) ||
+        (buf_size <= 0)) {
+        return MPLITE_ERR_INVPAR;
     }
-    else {
-        mplite_getlink(handle, prev)->next = next;
+
+    /* Escape the label value as the format requires */
+    for (ii = 0, jj = 0; (name[ii] != '\0') &&
+        (jj < (int) sizeof (zLabel) - 2); ii++) {
+        if (('\\' == name[ii]) || ('"' == name[ii])) {
+            zLabel[jj++] = '\\';
+            zLabel[jj++] = name[ii];
+        }
+        else if ('\n' == name[ii]) {
+            zLabel[jj++] = '\\';
+            zLabel[jj++] = 'n';
+        }
+        else {
+            zLabel[jj++] = name[ii];
+        }
     }
-    if (next >= 0) {
-        mplite_getlink(handle, next)->prev = prev;
+    zLabel[jj] = '\0';
+
+    buf[0] = '\0';
+    for (ii = 0; ii < (int) (sizeof (aTotal) / sizeof (aTotal[0])); ii++) {
+        snprintf(zLine, sizeof (zLine), "# HELP %s %s\n# TYPE %s %s\n"
+                 "%s{pool=\"%s\"} %llu\n", aTotal[ii].zName, aTotal[ii].zHelp,
+                 aTotal[ii].zName, aTotal[ii].zType, aTotal[ii].zName, zLabel,
+                 (unsigned long long) *(const uint64_t *)
+                 ((const uint8_t *) stats + aTotal[ii].iOffset));
+        if (mplite_export_append(buf, buf_size, &nOut, zLine) != MPLITE_OK) {
+            return MPLITE_ERR_INVPAR;
+        }
+    }
+    for (ii = 0; ii < (int) (sizeof (aOrder) / sizeof (aOrder[0])); ii++) {
+        const uint64_t *aValue = (const uint64_t *)
+                ((const uint8_t *) stats + aOrder[ii].iOffset);
+
+        snprintf(zLine, sizeof (zLine), "# HELP %s %s\n# TYPE %s %s\n",
+                 aOrder[ii].zName, aOrder[ii].zHelp, aOrder[ii].zName,
+                 aOrder[ii].zType);
+        if (mplite_export_append(buf, buf_size, &nOut, zLine) != MPLITE_OK) {
+            return MPLITE_ERR_INVPAR;
+        }
+        for (jj = 0; jj < stats->nOrder; jj++) {
+            snprintf(zLine, sizeof (zLine), "%s{pool=\"%s\",order=\"%d\","
+                     "block_bytes=\"%llu\"} %llu\n", aOrder[ii].zName, zLabel,
+                     jj, (unsigned long long) (stats->szAtom << jj),
+                     (unsigned long long) aValue[jj]);
+            if (mplite_export_append(buf, buf_size, &nOut, zLine) !=
+                MPLITE_OK) {
+                return MPLITE_ERR_INVPAR;
+            }
+        }
     }
+
+    return nOut;
 }
 
-/*
- ** Find the first entry on the freelist iLogsize.  Unlink that
- ** entry and return its index.
- */
-static int mplite_unlink_first(mplite_t *handle, const int iLogsize)
+MPLITE_API mplite_int_t mplite_walk(mplite_t *handle,
+                                    const mplite_walkfunc_t walkfunc,
+                                    void *arg)
 {
-    int i;
-    int iFirst;
+    mplite_int_t i;
+    mplite_int_t nVisit = 0;
+    int bStop = 0;
+    int ii;
 
-    assert(iLogsize >= 0 && iLogsize <= MPLITE_LOGMAX);
-    i = iFirst = handle->aiFreelist[iLogsize];
-    assert(iFirst >= 0);
-    while (i > 0) {
-        if (i < iFirst) iFirst = i;
-        i = mplite_getlink(handle, i)->next;
+    /* Check the parameters */
+    if ((NULL == handle) || (NULL == walkfunc)) {
+        return MPLITE_ERR_INVPAR;
     }
-    mplite_unlink(handle, iFirst, iLogsize);
-    return iFirst;
+
+    /* Hop from the control byte of one block to the next. Each block is
+     ** visited in a single step, however large it is. The regions follow the
+     ** pool in the order they were added.
+     */
+    mplite_enter(handle);
+    for (ii = 0; (ii <= handle->nRegion) && !bStop; ii++) {
+        const mplite_t *pPool = (0 == ii) ? handle : handle->apRegion[ii - 1];
+
+        for (i = 0; i < pPool->nBlock; nVisit++) {
+            const int iLogsize = pPool->aCtrl[i] & MPLITE_CTRL_LOGSIZE;
+            const int bUsed = (pPool->aCtrl[i] & MPLITE_CTRL_FREE) == 0;
+
+            assert((i + mplite_pow2(iLogsize)) <= pPool->nBlock);
+            if (walkfunc(arg, mplite_block(pPool, i),
+                         mplite_atom(pPool) << iLogsize, bUsed) != 0) {
+                nVisit++;
+                bStop = 1;
+                break;
+            }
+            i += mplite_pow2(iLogsize);
+        }
+    }
+    mplite_leave(handle);
+
+    return nVisit;
 }
 
-/*
- ** Return a block of memory of at least nBytes in size.
- ** Return NULL if unable.  Return NULL if nBytes==0.
- **
- ** The caller guarantees that nByte positive.
- **
- ** The caller has obtained a lock prior to invoking this
- ** routine so there is never any chance that two or more
- ** threads can be in this routine at the same time.
- */
-static void *mplite_malloc_unsafe(mplite_t *handle, const int nByte)
+MPLITE_API int mplite_get_frag(mplite_t *handle, mplite_frag_t *frag)
 {
-    int i; /* Index of a handle->aPool[] slot */
-    int iBin; /* Index into handle->aiFreelist[] */
-    int iFullSz; /* Size of allocation rounded up to power of 2 */
-    int iLogsize; /* Log2 of iFullSz/POW2_MIN */
+    mplite_stats_t stats;
+    int64_t nMax; /* Maximum checkout in atoms */
+    int64_t nLargest; /* Largest request rounded up, in atoms */
+    int iLog = 0;
+    int ii;
 
-    /* nByte must be a positive */
-    assert(nByte > 0);
+    /* Check the parameters */
+    if ((NULL == frag) || (mplite_get_stats(handle, &stats) != MPLITE_OK)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    memset(frag, 0, sizeof (*frag));
+    frag->nPoolBytes = stats.nPoolBytes;
+    frag->nOrder = stats.nOrder;
+    for (ii = 0; ii < stats.nOrder; ii++) {
+        frag->anFreeBlock[ii] = stats.anFreeBlock[ii];
+        frag->nFreeBytes += stats.anFreeBlock[ii] * (stats.szAtom << ii);
+        if (stats.anFreeBlock[ii] > 0) {
+            frag->nLargestFree = stats.szAtom << ii;
+        }
+    }
+
+    /* N >= M*(1 + log2(n)/2) - n + 1, with every size counted in atoms.
+     ** maxRequest also counts requests that failed, so n is capped at the
+     ** largest block of the pool, and the bound is computed signed and kept
+     ** from going negative when n is large next to M.
+     */
+    while ((iLog + 1 < stats.nOrder) &&
+           ((stats.szAtom << iLog) < stats.maxRequest)) {
+        iLog++;
+    }
+    nMax = (int64_t) (stats.maxOut / stats.szAtom);
+    nLargest = (int64_t) 1 << iLog;
+    if ((nMax > 0) && (nMax + (nMax * iLog + 1) / 2 - nLargest + 1 > 0)) {
+        frag->nRobsonBytes = (uint64_t) (nMax + (nMax * iLog + 1) / 2 -
+                nLargest + 1) * stats.szAtom;
+    }
+    frag->nHeadroom = (int64_t) frag->nPoolBytes -
+            (int64_t) frag->nRobsonBytes;
+
+    return MPLITE_OK;
+}
+
+MPLITE_API mplite_int_t mplite_largest_free(mplite_t *handle)
+{
+    mplite_mask_t mFreeOrders;
+    int ii;
+
+    if (NULL == handle) {
+        return 0;
+    }
+
+    /* The highest non-empty order is the top bit of mFreeOrders, which
+     ** mplite_link and mplite_unlink keep up to date. A block on a quick list
+     ** is as good as free since a failing request coalesces it.
+     */
+    mplite_enter(handle);
+    mFreeOrders = handle->mFreeOrders | handle->mQuickOrders;
+    for (ii = 0; ii < handle->nRegion; ii++) {
+        mFreeOrders |= handle->apRegion[ii]->mFreeOrders |
+                handle->apRegion[ii]->mQuickOrders;
+    }
+    mplite_leave(handle);
+    if (0 == mFreeOrders) {
+        return 0;
+    }
+    return handle->szAtom << (MPLITE_INT_BITS - 1 -
+            mplite_clz_mask(mFreeOrders));
+}
+
+MPLITE_API int mplite_add_region(mplite_t *handle, void *buf,
+                                 const mplite_int_t buf_size)
+{
+    mplite_t *pRegion;
+    mplite_int_t nSkip; /* Bytes skipped to align the region object */
+    int iRet = MPLITE_ERR_INVPAR;
+
+    /* Check the parameters. Every block of a persistent or shared pool lives
+     ** in its file.
+     */
+    if ((NULL == handle) || (NULL == buf) || (buf_size <= 0) ||
+        (handle->pFile != NULL)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    /* The region is a pool of its own without a lock, whose object takes the
+     ** start of the buffer.
+     */
+    nSkip = (mplite_int_t) ((0 - (uintptr_t) buf) & (MPLITE_CACHE_LINE - 1));
+    if (buf_size <= nSkip + (mplite_int_t) sizeof (mplite_t)) {
+        return MPLITE_ERR_INVPAR;
+    }
+    pRegion = (mplite_t *) ((uint8_t *) buf + nSkip);
+    if ((mplite_init(pRegion, pRegion + 1, buf_size - nSkip -
+                     (mplite_int_t) sizeof (mplite_t), (int) handle->szAtom,
+                     NULL) != MPLITE_OK) || (0 == pRegion->nBlock)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    /* Trace records only know the blocks of the pool itself */
+    mplite_enter(handle);
+    if ((NULL == handle->pTrace) && (handle->nRegion < MPLITE_REGION_MAX)) {
+        pRegion->nQuickOrder = handle->nQuickOrder;
+        pRegion->nQuickMax = handle->nQuickMax;
+        handle->apRegion[handle->nRegion] = pRegion;
+        handle->nRegion++;
+        iRet = MPLITE_OK;
+    }
+    mplite_leave(handle);
+
+    return iRet;
+}
+
+MPLITE_API int mplite_reset(mplite_t *handle)
+{
+    int iRet = MPLITE_ERR_INVPAR;
+    int ii;
+
+    /* Check the parameters */
+    if ((NULL == handle) || (handle->pFile != NULL)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    mplite_enter(handle);
+    if (NULL == handle->pTrace) {
+        if (mplite_remote_pending(handle)) {
+            mplite_remote_drain(handle);
+        }
+        mplite_format(handle);
+        for (ii = 0; ii < handle->nRegion; ii++) {
+            mplite_format(handle->apRegion[ii]);
+        }
+        iRet = MPLITE_OK;
+    }
+    mplite_leave(handle);
+
+    return iRet;
+}
+
+MPLITE_API mplite_int_t mplite_mark_size(mplite_t *handle)
+{
+    mplite_int_t nByte;
+    int ii;
+
+    /* Check the parameters */
+    if (NULL == handle) {
+        return 0;
+    }
+
+    mplite_enter(handle);
+    nByte = mplite_save_size(handle);
+    for (ii = 0; ii < handle->nRegion; ii++) {
+        nByte += mplite_save_size(handle->apRegion[ii]);
+    }
+    mplite_leave(handle);
+
+    return nByte;
+}
+
+MPLITE_API int mplite_mark(mplite_t *handle, void *mark,
+                           const mplite_int_t mark_size)
+{
+    uint8_t *zMark = (uint8_t *) mark;
+    mplite_int_t nByte;
+    int ii;
+
+    /* Check the parameters */
+    if ((NULL == handle) || (NULL == mark) || (((uintptr_t) mark & 7) != 0) ||
+        (handle->pFile != NULL)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    mplite_enter(handle);
+    nByte = mplite_save_size(handle);
+    for (ii = 0; ii < handle->nRegion; ii++) {
+        nByte += mplite_save_size(handle->apRegion[ii]);
+    }
+    if ((handle->pTrace != NULL) || (mark_size < nByte)) {
+        mplite_leave(handle);
+        return MPLITE_ERR_INVPAR;
+    }
+
+    /* The blocks of the quick lists and of the remote-free queue are linked
+     ** through their first bytes, which are not saved, so give them back
+     ** first.
+     */
+    if (mplite_remote_pending(handle)) {
+        mplite_remote_drain(handle);
+    }
+    for (ii = 0; ii <= handle->nRegion; ii++) {
+        mplite_t *pPool = (0 == ii) ? handle : handle->apRegion[ii - 1];
+        mplite_save_t *pSave = (mplite_save_t *) zMark;
+
+        mplite_quick_flush(pPool);
+        pSave->pPool = pPool;
+        pSave->nByte = (mplite_int_t) (pPool->aCtrl + pPool->nBlock -
+                (const uint8_t *) pPool->aMap);
+        pSave->nRegion = (0 == ii) ? handle->nRegion : 0;
+        memcpy(pSave->aiFreelist, pPool->aiFreelist,
+               sizeof (pSave->aiFreelist));
+        memcpy(pSave->anFreeBlock, pPool->anFreeBlock,
+               sizeof (pSave->anFreeBlock));
+        pSave->mFreeOrders = pPool->mFreeOrders;
+        pSave->currentOut = pPool->currentOut;
+        pSave->currentCount = pPool->currentCount;
+        memcpy(pSave + 1, pPool->aMap, pSave->nByte);
+        zMark += mplite_save_size(pPool);
+    }
+    mplite_leave(handle);
+
+    return MPLITE_OK;
+}
+
+MPLITE_API int mplite_release_to_mark(mplite_t *handle, const void *mark)
+{
+    const mplite_save_t *pSave = (const mplite_save_t *) mark;
+    const uint8_t *zMark = (const uint8_t *) mark;
+    int nSaved; /* Number of regions saved in the mark */
+    int ii;
+
+    /* Check the parameters */
+    if ((NULL == handle) || (NULL == mark) || (((uintptr_t) mark & 7) != 0) ||
+        (handle->pFile != NULL) || (pSave->pPool != handle)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    mplite_enter(handle);
+    nSaved = pSave->nRegion;
+    if ((handle->pTrace != NULL) || (nSaved > handle->nRegion)) {
+        mplite_leave(handle);
+        return MPLITE_ERR_INVPAR;
+    }
+    if (mplite_remote_pending(handle)) {
+        mplite_remote_drain(handle);
+    }
+
+    /* Restore the pool and the regions it had, and empty the regions added
+     ** since
+     */
+    for (ii = 0; ii <= handle->nRegion; ii++) {
+        mplite_t *pPool = (0 == ii) ? handle : handle->apRegion[ii - 1];
+
+        if (ii > nSaved) {
+            mplite_format(pPool);
+            continue;
+        }
+        pSave = (const mplite_save_t *) zMark;
+        assert(pSave->pPool == pPool);
+        memcpy(pPool->aMap, pSave + 1, pSave->nByte);
+        memcpy(pPool->aiFreelist, pSave->aiFreelist,
+               sizeof (pPool->aiFreelist));
+        memcpy(pPool->anFreeBlock, pSave->anFreeBlock,
+               sizeof (pPool->anFreeBlock));
+        pPool->mFreeOrders = pSave->mFreeOrders;
+        pPool->currentOut = pSave->currentOut;
+        pPool->currentCount = pSave->currentCount;
+        pPool->mQuickOrders = 0;
+        memset(pPool->anQuick, 0, sizeof (pPool->anQuick));
+        zMark += mplite_save_size(pPool);
+    }
+    mplite_leave(handle);
+
+    return MPLITE_OK;
+}
+
+MPLITE_API int mplite_lazy_init(mplite_t *handle, const int nOrder,
+                                const int nHighWater)
+{
+    int ii;
+
+    /* Check the parameters */
+    if ((NULL == handle) || (nOrder < 0) || (nOrder > MPLITE_QUICK_ORDERS) ||
+        (nHighWater < 0) || (handle->pFile != NULL)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    mplite_enter(handle);
+    for (ii = 0; ii <= handle->nRegion; ii++) {
+        mplite_t *pPool = (0 == ii) ? handle : handle->apRegion[ii - 1];
+        mplite_quick_flush(pPool);
+        pPool->nQuickOrder = nOrder;
+        pPool->nQuickMax = (nHighWater > 0) ? nHighWater : MPLITE_QUICK_MAX;
+    }
+    mplite_leave(handle);
+
+    return MPLITE_OK;
+}
+
+MPLITE_API int mplite_remote_init(mplite_t *handle, const int nThreshold)
+{
+#if MPLITE_HAVE_ATOMICS
+    return mplite_remote_setup(handle, nThreshold, &mplite_thread_tag);
+#else
+    (void) handle;
+    (void) nThreshold;
+    return MPLITE_ERR_INVPAR;
+#endif /* #if MPLITE_HAVE_ATOMICS */
+}
+
+MPLITE_API void mplite_coalesce(mplite_t *handle)
+{
+    int ii;
+
+    if (NULL == handle) {
+        return;
+    }
+
+    mplite_enter(handle);
+    if (mplite_remote_pending(handle)) {
+        mplite_remote_drain(handle);
+    }
+    mplite_quick_flush(handle);
+    for (ii = 0; ii < handle->nRegion; ii++) {
+        mplite_quick_flush(handle->apRegion[ii]);
+    }
+    mplite_leave(handle);
+}
+
+MPLITE_API int mplite_trace_start(mplite_t *handle, mplite_trace_t *trace,
+                                  mplite_trace_rec_t *aRec,
+                                  const uint64_t nRec)
+{
+    /* Check the parameters */
+    if ((NULL == handle) || (NULL == trace) || (NULL == aRec) ||
+        (0 == nRec) || (handle->nRegion > 0)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    memset(trace, 0, sizeof (*trace));
+    trace->aRec = aRec;
+    trace->nRec = nRec;
+    trace->szAtom = (uint64_t) handle->szAtom;
+    trace->nBlock = (uint64_t) handle->nBlock;
+    trace->iStart = mplite_clock();
+
+    mplite_enter(handle);
+    handle->pTrace = trace;
+    mplite_leave(handle);
+
+    return MPLITE_OK;
+}
+
+MPLITE_API int mplite_trace_stop(mplite_t *handle)
+{
+    /* Check the parameters */
+    if (NULL == handle) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    mplite_enter(handle);
+    handle->pTrace = NULL;
+    mplite_leave(handle);
+
+    return MPLITE_OK;
+}
+
+MPLITE_API int mplite_trace_save(const mplite_trace_t *trace,
+                                 const char *path)
+{
+    mplite_trace_header_t hdr;
+    uint64_t iFirst;
+    uint64_t nHead;
+    FILE *pOut;
+    int bOk;
+
+    /* Check the parameters */
+    if ((NULL == trace) || (NULL == path)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    /* Once the ring has wrapped, the oldest record is the one at the write
+     ** position and the ring is written out in two pieces.
+     */
+    memset(&hdr, 0, sizeof (hdr));
+    hdr.magic = MPLITE_TRACE_MAGIC;
+    hdr.version = MPLITE_TRACE_VERSION;
+    hdr.szRec = (uint32_t) sizeof (mplite_trace_rec_t);
+    hdr.szAtom = trace->szAtom;
+    hdr.nBlock = trace->nBlock;
+    hdr.nRec = trace->nTotal;
+    hdr.nLost = 0;
+    iFirst = 0;
+    if (trace->nTotal > trace->nRec) {
+        hdr.nRec = trace->nRec;
+        hdr.nLost = trace->nTotal - trace->nRec;
+        iFirst = trace->nTotal % trace->nRec;
+    }
+    nHead = trace->nRec - iFirst;
+    if (nHead > hdr.nRec) {
+        nHead = hdr.nRec;
+    }
+
+    pOut = fopen(path, "wb");
+    if (NULL == pOut) {
+        return MPLITE_ERR_FILE;
+    }
+    bOk = (fwrite(&hdr, sizeof (hdr), 1, pOut) == 1) &&
+            (fwrite(&trace->aRec[iFirst], sizeof (mplite_trace_rec_t),
+                    (size_t) nHead, pOut) == (size_t) nHead) &&
+            (fwrite(trace->aRec, sizeof (mplite_trace_rec_t),
+                    (size_t) (hdr.nRec - nHead), pOut) ==
+             (size_t) (hdr.nRec - nHead));
+    if (fclose(pOut) != 0) {
+        bOk = 0;
+    }
+
+    return bOk ? MPLITE_OK : MPLITE_ERR_FILE;
+}
+
+MPLITE_API int mplite_tcache_init(mplite_tcache_t *cache, mplite_t *handle,
+                                  const int capacity)
+{
+    /* Check the parameters */
+    if ((NULL == cache) || (NULL == handle) || (capacity < 0)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    memset(cache, 0, sizeof (*cache));
+    cache->pool = handle;
+    cache->nCapacity = (capacity > 0) ? capacity : MPLITE_TCACHE_CAPACITY;
+    cache->nBatch = (cache->nCapacity + 1) / 2;
+
+    return MPLITE_OK;
+}
+
+MPLITE_API void *mplite_tcache_malloc(mplite_tcache_t *cache,
+                                      const mplite_int_t nBytes)
+{
+    int iLogsize;
+    void *p;
+
+    /* Check the parameters */
+    if ((NULL == cache) || (nBytes <= 0)) {
+        return NULL;
+    }
+
+    if (nBytes > MPLITE_MAX_ALLOC_SIZE) {
+        return NULL;
+    }
+    iLogsize = mplite_order(cache->pool, nBytes);
+    if (iLogsize >= MPLITE_TCACHE_ORDERS) {
+        return mplite_malloc(cache->pool, nBytes);
+    }
+
+    p = cache->apMagazine[iLogsize];
+    if (p != NULL) {
+        cache->apMagazine[iLogsize] = *(void **) p;
+        cache->anMagazine[iLogsize]--;
+        cache->nHit++;
+        return p;
+    }
+    cache->nMiss++;
+    return mplite_tcache_refill(cache, iLogsize);
+}
+
+MPLITE_API void mplite_tcache_free(mplite_tcache_t *cache, const void *pPrior)
+{
+    mplite_t *handle;
+    int iLogsize;
+
+    /* Check the parameters */
+    if ((NULL == cache) || (NULL == pPrior)) {
+        return;
+    }
+
+    /* The control byte of a checked out block is only written by whoever
+     ** frees it, so it can be read without holding the pool lock.
+     */
+    handle = mplite_region(cache->pool, pPrior);
+    iLogsize = handle->aCtrl[mplite_index(handle, pPrior)] &
+            MPLITE_CTRL_LOGSIZE;
+    if (iLogsize >= MPLITE_TCACHE_ORDERS) {
+        handle = cache->pool;
+        mplite_free(handle, pPrior);
+        return;
+    }
+
+    if (cache->anMagazine[iLogsize] >= cache->nCapacity) {
+        mplite_tcache_drain(cache, iLogsize, cache->nBatch);
+    }
+    *(void **) pPrior = cache->apMagazine[iLogsize];
+    cache->apMagazine[iLogsize] = (void *) pPrior;
+    cache->anMagazine[iLogsize]++;
+}
+
+MPLITE_API void mplite_tcache_flush(mplite_tcache_t *cache)
+{
+    int iLogsize;
+
+    /* Check the parameters */
+    if (NULL == cache) {
+        return;
+    }
+
+    for (iLogsize = 0; iLogsize < MPLITE_TCACHE_ORDERS; iLogsize++) {
+        if (cache->anMagazine[iLogsize] > 0) {
+            mplite_tcache_drain(cache, iLogsize, cache->anMagazine[iLogsize]);
+        }
+    }
+}
+
+MPLITE_API void mplite_tcache_exit(void *cache)
+{
+    mplite_tcache_flush((mplite_tcache_t *) cache);
+}
+
+MPLITE_API int mplite_set_init(mplite_set_t *set, mplite_t *shards,
+                               const int nShard, const void *buf,
+                               const mplite_int_t buf_size,
+                               const int min_alloc,
+                               const mplite_lock_t *locks, const int affinity)
+{
+    const void *aBuf[MPLITE_SET_MAX];
+    mplite_int_t anSize[MPLITE_SET_MAX];
+    mplite_int_t nSlice;
+    int ii;
+
+    /* Check the parameters */
+    if ((NULL == buf) || (nShard <= 0) || (nShard > MPLITE_SET_MAX) ||
+        (buf_size / nShard <= 0)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    /* Give every shard an equal slice and the last one the remainder */
+    nSlice = buf_size / nShard;
+    for (ii = 0; ii < nShard; ii++) {
+        aBuf[ii] = (const uint8_t *) buf + ii * nSlice;
+        anSize[ii] = nSlice;
+    }
+    anSize[nShard - 1] += buf_size - nShard * nSlice;
+
+    return mplite_set_init_multi(set, shards, nShard, aBuf, anSize, min_alloc,
+                                 locks, affinity);
+}
+
+MPLITE_API int mplite_set_init_multi(mplite_set_t *set, mplite_t *shards,
+                                     const int nShard,
+                                     const void * const *bufs,
+                                     const mplite_int_t *buf_sizes,
+                                     const int min_alloc,
+                                     const mplite_lock_t *locks,
+                                     const int affinity)
+{
+    int ii, jj;
+
+    /* Check the parameters */
+    if ((NULL == set) || (NULL == shards) || (NULL == bufs) ||
+        (NULL == buf_sizes) || (nShard <= 0) || (nShard > MPLITE_SET_MAX) ||
+        ((affinity != MPLITE_AFFINITY_THREAD) &&
+         (affinity != MPLITE_AFFINITY_CPU))) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    memset(set, 0, sizeof (*set));
+    for (ii = 0; ii < nShard; ii++) {
+        mplite_t *pShard = &shards[ii];
+        int iRet = mplite_init(pShard, bufs[ii], buf_sizes[ii], min_alloc,
+                               ((NULL == locks) || mplite_lock_builtin(locks)) ?
+                               locks : &locks[ii]);
+        if (iRet != MPLITE_OK) {
+            return iRet;
+        }
+
+        /* Insertion sort by address, there are only a handful of shards */
+        for (jj = ii; (jj > 0) && (set->apShard[jj - 1]->zPool >
+            pShard->zPool); jj--) {
+            set->apShard[jj] = set->apShard[jj - 1];
+        }
+        set->apShard[jj] = pShard;
+    }
+    set->nShard = nShard;
+    set->affinity = affinity;
+
+    return MPLITE_OK;
+}
+
+MPLITE_API void *mplite_set_malloc(mplite_set_t *set,
+                                   const mplite_int_t nBytes)
+{
+    int iHome;
+    int ii;
+
+    /* Check the parameters */
+    if ((NULL == set) || (nBytes <= 0)) {
+        return NULL;
+    }
+
+    /* Try the home shard first, then steal from the others in turn */
+    iHome = mplite_set_home(set);
+    for (ii = 0; ii < set->nShard; ii++) {
+        void *p = mplite_malloc(set->apShard[(iHome + ii) % set->nShard],
+                                nBytes);
+        if (p != NULL) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+MPLITE_API void mplite_set_free(mplite_set_t *set, const void *pPrior)
+{
+    mplite_t *pShard;
+
+    /* Check the parameters */
+    if ((NULL == set) || (NULL == pPrior)) {
+        return;
+    }
+
+    pShard = mplite_set_shard(set, pPrior);
+    assert(pShard != NULL);
+#if MPLITE_HAVE_ATOMICS
+    /* Memory of a shard other than the home shard waits on its queue */
+    if ((pShard->nRemoteMax > 0) &&
+        (pShard != set->apShard[mplite_set_home(set)])) {
+        mplite_remote_push(pShard, pPrior);
+        return;
+    }
+#endif /* #if MPLITE_HAVE_ATOMICS */
+    mplite_free(pShard, pPrior);
+}
+
+MPLITE_API int mplite_set_remote_init(mplite_set_t *set, const int nThreshold)
+{
+    int ii;
+
+    /* Check the parameters */
+    if ((NULL == set) || (set->nShard <= 0)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    for (ii = 0; ii < set->nShard; ii++) {
+        int iRet = mplite_remote_setup(set->apShard[ii], nThreshold, NULL);
+        if (iRet != MPLITE_OK) {
+            return iRet;
+        }
+    }
+
+    return MPLITE_OK;
+}
+
+MPLITE_API mplite_t *mplite_set_shard(const mplite_set_t *set, const void *p)
+{
+    int iLo, iHi;
+
+    /* Check the parameters */
+    if ((NULL == set) || (NULL == p)) {
+        return NULL;
+    }
+
+    /* Find the last shard that starts at or below p */
+    iLo = 0;
+    iHi = set->nShard - 1;
+    while (iLo < iHi) {
+        int iMid = (iLo + iHi + 1) / 2;
+        if (set->apShard[iMid]->zPool <= (const uint8_t *) p) {
+            iLo = iMid;
+        }
+        else {
+            iHi = iMid - 1;
+        }
+    }
+    if ((set->nShard > 0) && (set->apShard[iLo]->zPool <= (const uint8_t *) p) &&
+        ((const uint8_t *) p < set->apShard[iLo]->zPool +
+         set->apShard[iLo]->nBlock * set->apShard[iLo]->szAtom)) {
+        return set->apShard[iLo];
+    }
+
+    /* Otherwise p may lie in a region of a shard */
+    for (iLo = 0; iLo < set->nShard; iLo++) {
+        if (mplite_region(set->apShard[iLo], p) != set->apShard[iLo]) {
+            return set->apShard[iLo];
+        }
+    }
+
+    return NULL;
+}
+
+MPLITE_API int mplite_slab_init(mplite_slab_t *slab, mplite_t *handle,
+                                const int *sizes, const int nSize,
+                                const mplite_int_t slab_size)
+{
+    static const int aDefault[] = {
+        16, 24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448
+    };
+    const int *aSize = sizes;
+    int nClass = nSize;
+    int ii;
+
+    if (NULL == sizes) {
+        aSize = aDefault;
+        nClass = (int) (sizeof (aDefault) / sizeof (aDefault[0]));
+    }
+
+    /* Check the parameters */
+    if ((NULL == slab) || (NULL == handle) || (nClass <= 0) ||
+        (nClass > MPLITE_SLAB_CLASSES) || (slab_size < 0) ||
+        (slab_size > MPLITE_MAX_ALLOC_SIZE)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    memset(slab, 0, sizeof (*slab));
+    slab->pool = handle;
+    slab->iSlabLog = mplite_order(handle,
+                                  (slab_size > 0) ? slab_size : MPLITE_SLAB_SIZE);
+    slab->szSlab = handle->szAtom << slab->iSlabLog;
+    slab->nClass = nClass;
+
+    /* Size each class so that the header, the bitmap and the slots fit in a
+     ** slab. The bitmap takes a bit per slot, rounded up to whole words.
+     */
+    for (ii = 0; ii < nClass; ii++) {
+        const mplite_int_t nHeader = (mplite_int_t)
+                offsetof(mplite_slab_page_t, aFree);
+        mplite_int_t nSlot;
+
+        if ((aSize[ii] <= 0) || ((ii > 0) && (aSize[ii] <= aSize[ii - 1]))) {
+            return MPLITE_ERR_INVPAR;
+        }
+        slab->anSize[ii] = (aSize[ii] + 7) & ~7;
+        nSlot = (slab->szSlab - nHeader) / slab->anSize[ii];
+        while ((nSlot > 0) && (nHeader + ((nSlot + 63) / 64) *
+            (mplite_int_t) sizeof (uint64_t) + nSlot * slab->anSize[ii] >
+            slab->szSlab)) {
+            nSlot--;
+        }
+        if (nSlot < 2) {
+            return MPLITE_ERR_INVPAR;
+        }
+        slab->anSlot[ii] = (int) nSlot;
+        slab->anOffset[ii] = (int) (nHeader + ((nSlot + 63) / 64) *
+                (mplite_int_t) sizeof (uint64_t));
+    }
+
+    return MPLITE_OK;
+}
+
+MPLITE_API void *mplite_slab_malloc(mplite_slab_t *slab,
+                                    const mplite_int_t nBytes)
+{
+    int iClass;
+    void *p;
+
+    /* Check the parameters */
+    if ((NULL == slab) || (nBytes <= 0)) {
+        return NULL;
+    }
+
+    iClass = mplite_slab_class(slab, nBytes);
+    if (iClass < 0) {
+        return mplite_malloc(slab->pool, nBytes);
+    }
+
+    mplite_enter(slab->pool);
+    p = mplite_slab_get(slab, iClass);
+    if (NULL == p) {
+        p = mplite_malloc_unsafe(slab->pool, nBytes);
+    }
+    mplite_leave(slab->pool);
+
+    return p;
+}
+
+MPLITE_API void mplite_slab_free(mplite_slab_t *slab, const void *pPrior)
+{
+    mplite_t *handle;
+    mplite_t *pPool; /* Pool or region that holds pPrior */
+    mplite_int_t iSlab;
+
+    /* Check the parameters */
+    if ((NULL == slab) || (NULL == pPrior)) {
+        return;
+    }
+
+    /* A slot lies inside the slab block that starts at the slab size
+     ** boundary below it. Any other allocation either starts at that boundary
+     ** itself or lies in a part of the pool split into smaller blocks, and
+     ** neither carries the slab mark in its control byte.
+     */
+    handle = slab->pool;
+    pPool = mplite_region(handle, pPrior);
+    iSlab = mplite_index(pPool, pPrior) & ~(mplite_pow2(slab->iSlabLog) - 1);
+
+    mplite_enter(handle);
+    if (pPool->aCtrl[iSlab] == (MPLITE_CTRL_SLAB | slab->iSlabLog)) {
+        mplite_slab_put(slab, (mplite_slab_page_t *)
+                        mplite_block(pPool, iSlab), pPrior);
+    }
+    else {
+        mplite_free_unsafe(handle, pPrior);
+    }
+    mplite_leave(handle);
+}
+
+MPLITE_API int mplite_init_file(mplite_t *handle, const char *path,
+                                const mplite_int_t file_size,
+                                const int min_alloc,
+                                const mplite_lock_t *lock)
+{
+    /* Check the parameters */
+    if ((NULL == handle) || (NULL == path) ||
+        (file_size <= MPLITE_FILE_HEADER) || (min_alloc <= 0)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    return mplite_file_create(handle, path, 0, file_size, min_alloc, lock);
+}
+
+MPLITE_API int mplite_attach(mplite_t *handle, const char *path,
+                             const mplite_lock_t *lock)
+{
+    mplite_file_header_t *pHdr;
+    int rc;
+
+    /* Check the parameters */
+    if ((NULL == handle) || (NULL == path)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    /* The pool must have been detached cleanly by a build of the library
+     ** with the same layout.
+     */
+    rc = mplite_file_open(handle, path, 0);
+    if (rc != MPLITE_OK) {
+        return rc;
+    }
+    pHdr = (mplite_file_header_t *) handle->pFile;
+    if (pHdr->bClean != 1) {
+        mplite_file_unmap(pHdr, (mplite_int_t) pHdr->nFile);
+        memset(handle, 0, sizeof (*handle));
+        return MPLITE_ERR_FILE;
+    }
+    mplite_file_load(handle, pHdr);
+    mplite_count_free(handle);
+    if (mplite_lock_setup(handle, lock) != MPLITE_OK) {
+        mplite_file_unmap(pHdr, (mplite_int_t) pHdr->nFile);
+        memset(handle, 0, sizeof (*handle));
+        return MPLITE_ERR_INVPAR;
+    }
+
+    /* The copy in the header is stale from now on until the next detach */
+    pHdr->bClean = 0;
+    mplite_file_sync(pHdr, MPLITE_FILE_HEADER);
+
+    return MPLITE_OK;
+}
+
+MPLITE_API int mplite_init_shared(mplite_t *handle, const char *name,
+                                  const mplite_int_t shm_size,
+                                  const int min_alloc)
+{
+    /* Check the parameters */
+    if ((NULL == handle) || (NULL == name) ||
+        (shm_size <= MPLITE_FILE_HEADER) || (min_alloc <= 0)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    return mplite_file_create(handle, name, 1, shm_size, min_alloc, NULL);
+}
+
+MPLITE_API int mplite_attach_shared(mplite_t *handle, const char *name)
+{
+    mplite_file_header_t *pHdr;
+    int rc;
+
+    /* Check the parameters */
+    if ((NULL == handle) || (NULL == name)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    rc = mplite_file_open(handle, name, 1);
+    if (rc != MPLITE_OK) {
+        return rc;
+    }
+    handle->lock.arg = handle;
+    handle->lock.acquire = mplite_shm_acquire;
+    handle->lock.release = mplite_shm_release;
+
+    pHdr = (mplite_file_header_t *) handle->pFile;
+    mplite_enter(handle);
+    pHdr->nRef++;
+    mplite_leave(handle);
+
+    return MPLITE_OK;
+}
+
+MPLITE_API int mplite_detach(mplite_t *handle)
+{
+    mplite_file_header_t *pHdr;
+    int rc = MPLITE_OK;
+
+    /* Check the parameters */
+    if ((NULL == handle) || (NULL == handle->pFile)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    pHdr = (mplite_file_header_t *) handle->pFile;
+    mplite_enter(handle);
+    if (pHdr->bShared) {
+        /* The header of a shared pool is always current */
+        assert(pHdr->nRef > 0);
+        pHdr->nRef--;
+    }
+    else {
+        mplite_file_save(handle, pHdr);
+
+        /* Write the pool out before stamping the header as valid, so that a
+         ** crash in between leaves a file that mplite_attach() refuses.
+         */
+        if (mplite_file_sync(pHdr, (mplite_int_t) pHdr->nFile) != 0) {
+            rc = MPLITE_ERR_FILE;
+        }
+        pHdr->bClean = 1;
+        if (mplite_file_sync(pHdr, MPLITE_FILE_HEADER) != 0) {
+            rc = MPLITE_ERR_FILE;
+        }
+    }
+    mplite_leave(handle);
+
+    mplite_file_unmap(pHdr, (mplite_int_t) pHdr->nFile);
+    memset(handle, 0, sizeof (*handle));
+
+    return rc;
+}
+
+/*
+ ** Make handle use the built-in lock selected by one of the sentinel lock
+ ** pointers, or a copy of the lock callbacks in lock if it is not NULL.
+ */
+static int mplite_lock_setup(mplite_t *handle, const mplite_lock_t *lock)
+{
+    if (mplite_lock_builtin(lock)) {
+        if (!MPLITE_HAVE_ATOMICS) {
+            return MPLITE_ERR_INVPAR;
+        }
+        handle->lockPolicy = (int) (uintptr_t) lock;
+    }
+    else if (lock != NULL) {
+        memcpy(&handle->lock, lock, sizeof (handle->lock));
+    }
+    return MPLITE_OK;
+}
+
+/*
+ ** Return the ceiling of the logarithm base 2 of iValue.
+ **
+ ** Examples:   mplite_logarithm(1) -> 0
+ **             mplite_logarithm(2) -> 1
+ **             mplite_logarithm(4) -> 2
+ **             mplite_logarithm(5) -> 3
+ **             mplite_logarithm(8) -> 3
+ **             mplite_logarithm(9) -> 4
+ */
+static int mplite_logarithm(const mplite_int_t iValue)
+{
+    if (iValue <= 1) {
+        return 0;
+    }
+    return MPLITE_INT_BITS - mplite_clz_int(iValue - 1);
+}
+
+/*
+ ** Return the free list order that satisfies a request of nByte bytes, ie.
+ ** the log2 of nByte / handle->szAtom after rounding up to a power of two.
+ */
+static int mplite_order(const mplite_t *handle, const mplite_int_t nByte)
+{
+    int iLogsize = mplite_logarithm(nByte) - mplite_atom_log(handle);
+    return (iLogsize > 0) ? iLogsize : 0;
+}
+
+/*
+ ** Return the size of an outstanding allocation, in bytes.  The
+ ** size returned omits the 8-byte header overhead.  This only
+ ** works for chunks that are currently checked out.
+ */
+static mplite_int_t mplite_size(const mplite_t *handle, const void *p)
+{
+    mplite_int_t iSize = 0;
+    if (p) {
+        mplite_int_t i;
+        if (handle->nRegion > 0) {
+            handle = mplite_region(handle, p);
+        }
+        i = mplite_index(handle, p);
+        assert(i >= 0 && i < handle->nBlock);
+        iSize = mplite_atom(handle) <<
+                (handle->aCtrl[i] & MPLITE_CTRL_LOGSIZE);
+    }
+    return iSize;
+}
+
+/*
+ ** Compute where each level of each order's free block bitmap lives for a pool
+ ** of nBlock blocks, filling in handle->aMapOff[] and handle->anMapDepth[].
+ ** Return the total number of 64-bit words used by the bitmaps.
+ */
+static mplite_int_t mplite_map_layout(mplite_t *handle,
+                                      const mplite_int_t nBlock)
+{
+    mplite_int_t nWord = 0; /* Words used by the orders laid out so far */
+    int iLogsize;
+
+    for (iLogsize = 0; iLogsize <= MPLITE_LOGMAX; iLogsize++) {
+        int iLevel = 0;
+        mplite_int_t nBit; /* Number of bits in the current level */
+
+        handle->anMapDepth[iLogsize] = 0;
+        if ((nBlock >> iLogsize) == 0) {
+            continue;
+        }
+        nBit = ((nBlock - 1) >> iLogsize) + 1;
+        do {
+            assert(iLevel < MPLITE_MAPDEPTH);
+            nBit = (nBit >> 6) + ((nBit & 63) != 0);
+            handle->aMapOff[iLogsize][iLevel++] = nWord;
+            nWord += nBit;
+        } while (nBit > 1);
+        handle->anMapDepth[iLogsize] = iLevel;
+    }
+    return nWord;
+}
+
+/*
+ ** Give every block of a pool back to the free lists as the largest blocks
+ ** that fit, lowest address first, and empty the quick lists. Only the top
+ ** word of each bitmap is cleared, as mplite_map_set() clears the words below
+ ** when it first sets a bit in them, and control bytes are only read at the
+ ** start of a block, so this takes time in proportion to the number of
+ ** orders and not of blocks.
+ */
+static void mplite_format(mplite_t *handle)
+{
+    mplite_int_t iOffset = 0; /* An offset into handle->aCtrl[] */
+    int ii;
+
+    handle->mFreeOrders = 0;
+    handle->mQuickOrders = 0;
+    handle->currentOut = 0;
+    handle->currentCount = 0;
+    for (ii = 0; ii < MPLITE_QUICK_ORDERS; ii++) {
+        handle->anQuick[ii] = 0;
+    }
+    for (ii = 0; ii <= MPLITE_LOGMAX; ii++) {
+        handle->aiFreelist[ii] = -1;
+        handle->anFreeBlock[ii] = 0;
+        if (handle->anMapDepth[ii] > 0) {
+            handle->aMap[handle->aMapOff[ii][handle->anMapDepth[ii] - 1]] = 0;
+        }
+    }
+
+    for (ii = MPLITE_LOGMAX; ii >= 0; ii--) {
+        mplite_int_t nAlloc = mplite_pow2(ii);
+        if ((iOffset + nAlloc) <= handle->nBlock) {
+            handle->aCtrl[iOffset] = (uint8_t) (ii | MPLITE_CTRL_FREE);
+            mplite_link(handle, iOffset, ii);
+            iOffset += nAlloc;
+        }
+        assert((iOffset + nAlloc) > handle->nBlock);
+    }
+}
+
+/*
+ ** Return the bytes taken in the buffer of a mark by the saved state of a
+ ** pool or region.
+ */
+static mplite_int_t mplite_save_size(const mplite_t *handle)
+{
+    const mplite_int_t nByte = (mplite_int_t) (handle->aCtrl + handle->nBlock -
+            (const uint8_t *) handle->aMap);
+
+    return (mplite_int_t) sizeof (mplite_save_t) + ((nByte + 7) & ~7);
+}
+
+/*
+ ** Set bit iBit in the free block bitmap of order iLogsize.
+ **
+ ** A word below the top level is only meaningful while its summary bit in the
+ ** level above is set. Words are cleared the first time they come into use
+ ** rather than up front, so the bitmaps never need to be zeroed as a whole.
+ */
+static void mplite_map_set(mplite_t *handle, const int iLogsize,
+                           const mplite_int_t iBit)
+{
+    const mplite_int_t *aOff = handle->aMapOff[iLogsize];
+    int iLevel = handle->anMapDepth[iLogsize] - 1;
+    int bLive = 1; /* True if the word at iLevel holds valid bits */
+
+    assert(iLevel >= 0);
+    for (; iLevel >= 0; iLevel--) {
+        uint64_t *pWord = &handle->aMap[aOff[iLevel] +
+                mplite_map_word(iBit, iLevel)];
+        uint64_t mBit = (uint64_t) 1 <<
+                (((uint64_t) iBit >> (6 * iLevel)) & 63);
+        if (!bLive) {
+            *pWord = 0;
+        }
+        bLive = ((*pWord & mBit) != 0);
+        *pWord |= mBit;
+    }
+}
+
+/*
+ ** Clear bit iBit in the free block bitmap of order iLogsize, along with any
+ ** summary bits whose word in the level below became empty.
+ */
+static void mplite_map_clear(mplite_t *handle, const int iLogsize,
+                             mplite_int_t iBit)
+{
+    const mplite_int_t *aOff = handle->aMapOff[iLogsize];
+    int iLevel;
+
+    for (iLevel = 0; iLevel < handle->anMapDepth[iLogsize]; iLevel++) {
+        uint64_t *pWord = &handle->aMap[aOff[iLevel] + (iBit >> 6)];
+        *pWord &= ~((uint64_t) 1 << (iBit & 63));
+        if (*pWord != 0) {
+            break;
+        }
+        iBit >>= 6;
+    }
+}
+
+/*
+ ** Return the lowest bit set in the free block bitmap of order iLogsize or -1
+ ** if the bitmap is empty.
+ */
+static mplite_int_t mplite_map_first(const mplite_t *handle,
+                                     const int iLogsize)
+{
+    const mplite_int_t *aOff = handle->aMapOff[iLogsize];
+    int iLevel = handle->anMapDepth[iLogsize] - 1;
+    mplite_int_t iBit = 0;
+    uint64_t mWord;
+
+    assert(iLevel >= 0);
+    mWord = handle->aMap[aOff[iLevel]];
+    if (mWord == 0) {
+        return -1;
+    }
+    for (;;) {
+        iBit = (iBit << 6) + mplite_ctz64(mWord);
+        if (iLevel-- == 0) {
+            break;
+        }
+        mWord = handle->aMap[aOff[iLevel] + iBit];
+    }
+    return iBit;
+}
+
+/*
+ ** Link the chunk at handle->aPool[i] so that is on the iLogsize
+ ** free list.
+ */
+static void mplite_link(mplite_t *handle, const mplite_int_t i,
+                        const int iLogsize)
+{
+    assert(i >= 0 && i < handle->nBlock);
+    assert(iLogsize >= 0 && iLogsize <= MPLITE_LOGMAX);
+    assert((handle->aCtrl[i] & MPLITE_CTRL_LOGSIZE) == iLogsize);
+    assert((i & (mplite_pow2(iLogsize) - 1)) == 0);
+
+    mplite_map_set(handle, iLogsize, i >> iLogsize);
+    if ((handle->aiFreelist[iLogsize] < 0) ||
+        (i < handle->aiFreelist[iLogsize])) {
+        handle->aiFreelist[iLogsize] = i;
+    }
+    handle->mFreeOrders |= mplite_bit(iLogsize);
+    handle->anFreeBlock[iLogsize]++;
+}
+
+/*
+ ** Unlink the chunk at handle->aPool[i] from list it is currently
+ ** on.  It should be found on handle->aiFreelist[iLogsize].
+ */
+static void mplite_unlink(mplite_t *handle, const mplite_int_t i,
+                          const int iLogsize)
+{
+    assert(i >= 0 && i < handle->nBlock);
+    assert(iLogsize >= 0 && iLogsize <= MPLITE_LOGMAX);
+    assert((handle->aCtrl[i] & MPLITE_CTRL_LOGSIZE) == iLogsize);
+
+    mplite_map_clear(handle, iLogsize, i >> iLogsize);
+    handle->anFreeBlock[iLogsize]--;
+    if (handle->aiFreelist[iLogsize] == i) {
+        mplite_int_t iFirst = mplite_map_first(handle, iLogsize);
+        if (iFirst < 0) {
+            handle->aiFreelist[iLogsize] = -1;
+            handle->mFreeOrders &= ~mplite_bit(iLogsize);
+        }
+        else {
+            handle->aiFreelist[iLogsize] = iFirst << iLogsize;
+        }
+    }
+}
+
+/*
+ ** Find the first entry on the freelist iLogsize.  Unlink that
+ ** entry and return its index.
+ */
+static mplite_int_t mplite_unlink_first(mplite_t *handle, const int iLogsize)
+{
+    mplite_int_t iFirst;
+
+    assert(iLogsize >= 0 && iLogsize <= MPLITE_LOGMAX);
+    iFirst = handle->aiFreelist[iLogsize];
+    assert(iFirst >= 0);
+    mplite_unlink(handle, iFirst, iLogsize);
+    return iFirst;
+}
+
+/*
+ ** Return the bitmap of the non-empty free lists of order iLogsize or larger.
+ ** If there are none, coalesce the quick lists first.
+ */
+static mplite_mask_t mplite_avail(mplite_t *handle, const int iLogsize)
+{
+    const mplite_mask_t mMask = ~(mplite_bit(iLogsize) - 1);
+
+    if (((handle->mFreeOrders & mMask) == 0) &&
+        (handle->mQuickOrders != 0)) {
+        mplite_quick_flush(handle);
+    }
+    return handle->mFreeOrders & mMask;
+}
+
+/*
+ ** Return a block of memory of at least nBytes in size.
+ ** Return NULL if unable.  Return NULL if nBytes==0.
+ **
+ ** The caller guarantees that nByte positive.
+ **
+ ** The caller has obtained a lock prior to invoking this
+ ** routine so there is never any chance that two or more
+ ** threads can be in this routine at the same time.
+ */
+static void *mplite_malloc_unsafe(mplite_t *handle, const mplite_int_t nByte)
+{
+    mplite_int_t i; /* Index of a handle->aPool[] slot */
+    int iBin; /* Index into handle->aiFreelist[] */
+    int iLogsize; /* Log2 of the allocation size over szAtom */
+    mplite_mask_t mAvail; /* Non-empty free lists of order iLogsize or
+        larger */
+
+    /* nByte must be a positive */
+    assert(nByte > 0);
+
+    /* Give back the blocks freed by other threads first. A stale read of
+     ** pRemote only leaves them for the next call.
+     */
+    if (mplite_remote_pending(handle)) {
+        mplite_remote_drain(handle);
+    }
+
+    /* Keep track of the maximum allocation request.  Even unfulfilled
+     ** requests are counted */
+    if ((mplite_uint_t) nByte > handle->maxRequest) {
+        handle->maxRequest = (mplite_uint_t) nByte;
+    }
+
+    /* Abort if the requested allocation size is larger than the largest
+     ** power of two that we can represent using mplite_int_t.
+     */
+    if (nByte > MPLITE_MAX_ALLOC_SIZE) {
+        handle->nFail++;
+        return NULL;
+    }
+
+    /* Round nByte up to the next valid power of two */
+    iLogsize = mplite_order(handle, nByte);
+
+    /* A block on the quick list of the order needs no splitting */
+    if ((iLogsize < handle->nQuickOrder) && (handle->anQuick[iLogsize] > 0)) {
+        i = mplite_quick_pop(handle, iLogsize);
+        handle->aCtrl[i] = (uint8_t) iLogsize;
+        mplite_count_alloc(handle, nByte, iLogsize, 1);
+        return (void*) mplite_block(handle, i);
+    }
+
+    /* Make sure handle->aiFreelist[iLogsize] contains at least one free
+     ** block.  If not, then split a block of the smallest larger power of
+     ** two that has one in order to create a new free block of size iLogsize.
+     ** Coalesce the quick lists first if no free block is large enough, and
+     ** fall back on the regions if there is still none.
+     */
+    mAvail = mplite_avail(handle, iLogsize);
+    if (mAvail == 0) {
+        void *p = (handle->nRegion > 0) ?
+                mplite_region_alloc(handle, 0, nByte) : NULL;
+        if (NULL == p) {
+            handle->nFail++;
+        }
+        return p;
+    }
+    iBin = mplite_ctz_mask(mAvail);
+    i = mplite_unlink_first(handle, iBin);
+    while (iBin > iLogsize) {
+        mplite_int_t newSize;
+
+        handle->anSplit[iBin]++;
+        iBin--;
+        newSize = mplite_pow2(iBin);
+        handle->aCtrl[i + newSize] = (uint8_t) (MPLITE_CTRL_FREE | iBin);
+        mplite_link(handle, i + newSize, iBin);
+    }
+    handle->aCtrl[i] = (uint8_t) iLogsize;
+
+    /* Update allocator performance statistics. */
+    mplite_count_alloc(handle, nByte, iLogsize, 1);
+
+    /* Return a pointer to the allocated memory. */
+    return (void*) mplite_block(handle, i);
+}
+
+/*
+ ** Allocate up to nCount blocks of at least nByte bytes each and store them
+ ** in apOut[]. Return the number of blocks allocated, which is less than
+ ** nCount only if the pool ran out of blocks large enough.
+ **
+ ** Whenever a split is needed, the block is carved into as many siblings of
+ ** the requested size as are still wanted and only the rest of it is given
+ ** back to the free lists. The blocks handed out and the free lists left
+ ** behind are exactly those of nCount calls to mplite_malloc_unsafe().
+ **
+ ** The caller guarantees that nByte and nCount are positive and holds the
+ ** lock.
+ */
+static int mplite_malloc_batch_unsafe(mplite_t *handle,
+                                      const mplite_int_t nByte,
+                                      const int nCount, void **apOut)
+{
+    int iLogsize; /* Log2 of the allocation size over szAtom */
+    int n = 0; /* Number of blocks stored in apOut[] */
+    int ii;
+
+    assert(nByte > 0);
+    assert(nCount > 0);
+
+    if (mplite_remote_pending(handle)) {
+        mplite_remote_drain(handle);
+    }
+
+    if ((mplite_uint_t) nByte > handle->maxRequest) {
+        handle->maxRequest = (mplite_uint_t) nByte;
+    }
+    if (nByte > MPLITE_MAX_ALLOC_SIZE) {
+        handle->nFail += nCount;
+        return 0;
+    }
+
+    iLogsize = mplite_order(handle, nByte);
+
+    /* Take the blocks on the quick list of the order first */
+    while ((n < nCount) && (iLogsize < handle->nQuickOrder) &&
+           (handle->anQuick[iLogsize] > 0)) {
+        mplite_int_t i = mplite_quick_pop(handle, iLogsize);
+        handle->aCtrl[i] = (uint8_t) iLogsize;
+        apOut[n++] = (void *) mplite_block(handle, i);
+    }
+
+    while (n < nCount) {
+        mplite_mask_t mAvail; /* Non-empty free lists of order iLogsize or
+            larger */
+        int iBin; /* Order of the block being carved */
+        mplite_int_t i; /* Index of the block being carved */
+        mplite_int_t iOff; /* Offset in blocks from i */
+        mplite_int_t nSibling; /* Number of blocks carved out of block i */
+
+        mAvail = mplite_avail(handle, iLogsize);
+        if (mAvail == 0) {
+            break;
+        }
+        iBin = mplite_ctz_mask(mAvail);
+        i = mplite_unlink_first(handle, iBin);
+
+        nSibling = mplite_pow2(iBin - iLogsize);
+        if (nSibling > nCount - n) {
+            nSibling = nCount - n;
+        }
+        mplite_count_carve(handle, iBin, iLogsize, nSibling << iLogsize);
+        for (iOff = 0; iOff < (nSibling << iLogsize);
+            iOff += mplite_pow2(iLogsize)) {
+            handle->aCtrl[i + iOff] = (uint8_t) iLogsize;
+            apOut[n++] = (void *) mplite_block(handle, i + iOff);
+        }
+
+        /* Give back the tail as the buddy-aligned blocks a run of single
+         ** splits would have left. Each one is as large as its offset into
+         ** block i is aligned.
+         */
+        while (iOff < mplite_pow2(iBin)) {
+            int iLog = mplite_ctz_int(iOff);
+            handle->aCtrl[i + iOff] = (uint8_t) (MPLITE_CTRL_FREE | iLog);
+            mplite_link(handle, i + iOff, iLog);
+            iOff += mplite_pow2(iLog);
+        }
+    }
+
+    if (n > 0) {
+        mplite_count_alloc(handle, nByte, iLogsize, n);
+    }
+
+    /* Fill the shortfall from the regions. Their failures are counted once,
+     ** here.
+     */
+    for (ii = 0; (n < nCount) && (ii < handle->nRegion); ii++) {
+        mplite_t *pRegion = handle->apRegion[ii];
+        const uint64_t nFail = pRegion->nFail;
+
+        n += mplite_malloc_batch_unsafe(pRegion, nByte, nCount - n, &apOut[n]);
+        pRegion->nFail = nFail;
+        mplite_peak(handle);
+    }
+    handle->nFail += nCount - n;
+    return n;
+}
+
+/*
+ ** Return a block of at least nByte bytes whose address is a multiple of
+ ** nAlign, a power of two. Return NULL if there is no such block.
+ **
+ ** The block is carved out of a free block that holds an aligned address with
+ ** room for the request after it. Only the lowest free block of each order is
+ ** tried: a free block at least as large as the alignment always qualifies,
+ ** so smaller ones are just a cheaper fit. The halves split off on either side
+ ** of the carved block go back to the free lists.
+ **
+ ** The caller has obtained a lock prior to invoking this
+ ** routine so there is never any chance that two or more
+ ** threads can be in this routine at the same time.
+ */
+static void *mplite_memalign_unsafe(mplite_t *handle,
+                                    const mplite_int_t nAlign,
+                                    const mplite_int_t nByte)
+{
+    mplite_int_t iFullSz; /* Size of allocation rounded up to power of 2 */
+    int iLogsize; /* Log2 of iFullSz/POW2_MIN */
+    mplite_int_t iAligned; /* Index of the first aligned block */
+    mplite_int_t nStep; /* Blocks between two aligned addresses */
+    mplite_mask_t mAvail; /* Non-empty free lists left to try */
+    mplite_int_t nOff;
+
+    assert(nByte > 0);
+    assert((nAlign > 0) && ((nAlign & (nAlign - 1)) == 0));
+
+    if (mplite_remote_pending(handle)) {
+        mplite_remote_drain(handle);
+    }
+
+    if ((mplite_uint_t) nByte > handle->maxRequest) {
+        handle->maxRequest = (mplite_uint_t) nByte;
+    }
+    if (nByte > MPLITE_MAX_ALLOC_SIZE) {
+        handle->nFail++;
+        return NULL;
+    }
+    iLogsize = mplite_order(handle, nByte);
+    iFullSz = mplite_atom(handle) << iLogsize;
+
+    /* The aligned addresses are nOff bytes past zPool plus any multiple of
+     ** nAlign. The block must also start at a multiple of its own size.
+     */
+    nOff = (mplite_int_t) ((0 - (uintptr_t) handle->zPool) & (nAlign - 1));
+    iAligned = nOff >> mplite_atom_log(handle);
+    nStep = (nAlign > mplite_atom(handle)) ?
+            nAlign >> mplite_atom_log(handle) : 1;
+
+    mAvail = ((nOff & (iFullSz - 1)) == 0) ? mplite_avail(handle, iLogsize) :
+            0;
+    while (mAvail != 0) {
+        int iBin = mplite_ctz_mask(mAvail);
+        mplite_int_t i = handle->aiFreelist[iBin];
+        mplite_int_t iTarget = i + ((iAligned - i) & (nStep - 1));
+
+        mAvail &= mAvail - 1;
+        if (iTarget + mplite_pow2(iLogsize) > i + mplite_pow2(iBin)) {
+            /* Try again once the quick lists are coalesced */
+            if ((mAvail == 0) && (handle->mQuickOrders != 0)) {
+                mplite_quick_flush(handle);
+                mAvail = mplite_avail(handle, iLogsize);
+            }
+            continue;
+        }
+
+        /* Halve the block down to order iLogsize, keeping the half that holds
+         ** iTarget and freeing the other one.
+         */
+        mplite_unlink(handle, i, iBin);
+        while (iBin > iLogsize) {
+            mplite_int_t newSize;
+
+            handle->anSplit[iBin]++;
+            iBin--;
+            newSize = mplite_pow2(iBin);
+            if (iTarget >= i + newSize) {
+                handle->aCtrl[i] = (uint8_t) (MPLITE_CTRL_FREE | iBin);
+                mplite_link(handle, i, iBin);
+                i += newSize;
+            }
+            else {
+                handle->aCtrl[i + newSize] = (uint8_t) (MPLITE_CTRL_FREE |
+                        iBin);
+                mplite_link(handle, i + newSize, iBin);
+            }
+        }
+        assert(i == iTarget);
+        handle->aCtrl[i] = (uint8_t) iLogsize;
+
+        mplite_count_alloc(handle, nByte, iLogsize, 1);
+        return (void*) mplite_block(handle, i);
+    }
+
+    /* Fall back on the regions, whose blocks are aligned differently */
+    if (handle->nRegion > 0) {
+        void *p = mplite_region_alloc(handle, nAlign, nByte);
+        if (p != NULL) {
+            return p;
+        }
+    }
+    handle->nFail++;
+    return NULL;
+}
+
+/*
+ ** Update the performance statistics for nCount allocations of order iLogsize
+ ** made to satisfy requests of nByte bytes.
+ */
+static void mplite_count_alloc(mplite_t *handle, const mplite_int_t nByte,
+                               const int iLogsize, const int nCount)
+{
+    const mplite_int_t iFullSz = mplite_atom(handle) << iLogsize;
+
+    handle->nAlloc += nCount;
+    handle->anAlloc[iLogsize] += nCount;
+    handle->totalAlloc += (uint64_t) iFullSz * nCount;
+    handle->totalExcess += (uint64_t) (iFullSz - nByte) * nCount;
+    handle->currentCount += nCount;
+    handle->currentOut += (mplite_uint_t) iFullSz * nCount;
+    mplite_peak(handle);
+}
+
+/*
+ ** Raise the maximum checkout of a pool to its current checkout, which
+ ** includes the one of its regions.
+ */
+static void mplite_peak(mplite_t *handle)
+{
+    mplite_uint_t nOut = handle->currentOut;
+    mplite_uint_t nCount = handle->currentCount;
+    int ii;
+
+    for (ii = 0; ii < handle->nRegion; ii++) {
+        nOut += handle->apRegion[ii]->currentOut;
+        nCount += handle->apRegion[ii]->currentCount;
+    }
+    if (handle->maxCount < nCount) {
+        handle->maxCount = nCount;
+    }
+    if (handle->maxOut < nOut) {
+        handle->maxOut = nOut;
+    }
+}
+
+/*
+ ** Count the splits made by carving nCarve blocks of order iLogsize off the
+ ** start of a free block of order iBin and giving back the rest. A block of
+ ** order j is split if it lies entirely within the carved part or straddles
+ ** its end.
+ */
+static void mplite_count_carve(mplite_t *handle, const int iBin,
+                               const int iLogsize, const mplite_int_t nCarve)
+{
+    int iLog;
+
+    for (iLog = iLogsize + 1; iLog <= iBin; iLog++) {
+        handle->anSplit[iLog] += (uint64_t) (nCarve >> iLog) +
+                ((nCarve & (mplite_pow2(iLog) - 1)) != 0);
+    }
+}
+
+/*
+ ** Free an outstanding memory allocation.
+ */
+static void mplite_free_unsafe(mplite_t *handle, const void *pOld)
+{
+    mplite_int_t size;
+    int iLogsize;
+    mplite_int_t iBlock;
+
+    /* The block may belong to a region */
+    if (handle->nRegion > 0) {
+        handle = mplite_region(handle, pOld);
+    }
+
+    /* Set iBlock to the index of the block pointed to by pOld in
+     ** the array of handle->szAtom byte blocks pointed to by handle->zPool.
+     */
+    iBlock = mplite_index(handle, pOld);
+
+    /* Check that the pointer pOld points to a valid, non-free block. */
+    assert(iBlock >= 0 && iBlock < handle->nBlock);
+    assert((((uint8_t *) pOld - handle->zPool) & (mplite_atom(handle) - 1)) ==
+           0);
+    assert((handle->aCtrl[iBlock] & MPLITE_CTRL_FREE) == 0);
+
+    iLogsize = handle->aCtrl[iBlock] & MPLITE_CTRL_LOGSIZE;
+    size = mplite_pow2(iLogsize);
+    assert(iBlock + size - 1 < handle->nBlock);
+
+    handle->aCtrl[iBlock] |= MPLITE_CTRL_FREE;
+    handle->aCtrl[iBlock + size - 1] |= MPLITE_CTRL_FREE;
+    assert(handle->currentCount > 0);
+    assert(handle->currentOut >= (mplite_uint_t) (size * mplite_atom(handle)));
+    handle->currentCount--;
+    handle->currentOut -= (mplite_uint_t) (size * mplite_atom(handle));
+    handle->anFree[iLogsize]++;
+    assert(handle->currentOut > 0 || handle->currentCount == 0);
+    assert(handle->currentCount > 0 || handle->currentOut == 0);
+
+    if (iLogsize < handle->nQuickOrder) {
+        mplite_quick_push(handle, iBlock, iLogsize);
+    }
+    else {
+        mplite_merge(handle, iBlock, iLogsize);
+    }
+}
+
+/*
+ ** Give the free block iBlock of order iLogsize back to the free lists,
+ ** merging it with its buddy for as long as the buddy is free too.
+ */
+static void mplite_merge(mplite_t *handle, mplite_int_t iBlock, int iLogsize)
+{
+    mplite_int_t size = mplite_pow2(iLogsize);
+
+    handle->aCtrl[iBlock] = (uint8_t) (MPLITE_CTRL_FREE | iLogsize);
+    while (iLogsize < MPLITE_LOGMAX) {
+        mplite_int_t iBuddy;
+        if ((iBlock >> iLogsize) & 1) {
+            iBuddy = iBlock - size;
+        }
+        else {
+            iBuddy = iBlock + size;
+        }
+        assert(iBuddy >= 0);
+        if ((iBuddy + size) > handle->nBlock) break;
+        if (handle->aCtrl[iBuddy] != (MPLITE_CTRL_FREE | iLogsize)) break;
+        mplite_unlink(handle, iBuddy, iLogsize);
+        iLogsize++;
+        handle->anCoalesce[iLogsize]++;
+        if (iBuddy < iBlock) {
+            handle->aCtrl[iBuddy] = (uint8_t) (MPLITE_CTRL_FREE | iLogsize);
+            handle->aCtrl[iBlock] = 0;
+            iBlock = iBuddy;
+        }
+        else {
+            handle->aCtrl[iBlock] = (uint8_t) (MPLITE_CTRL_FREE | iLogsize);
+            handle->aCtrl[iBuddy] = 0;
+        }
+        size *= 2;
+    }
+    mplite_link(handle, iBlock, iLogsize);
+}
+
+/*
+ ** Put the block iBlock, just freed, on the quick list of order iLogsize
+ ** without merging it. The block is marked free, so walks and statistics
+ ** count it as such, but its control byte never equals the one of a free
+ ** block of its order, so its buddy is not merged with it either. The list
+ ** is coalesced once it holds more than nQuickMax blocks.
+ */
+static void mplite_quick_push(mplite_t *handle, const mplite_int_t iBlock,
+                              const int iLogsize)
+{
+    handle->aCtrl[iBlock] = (uint8_t) (MPLITE_CTRL_QUICK | iLogsize);
+    *(mplite_int_t *) mplite_block(handle, iBlock) = handle->aiQuick[iLogsize];
+    handle->aiQuick[iLogsize] = iBlock;
+    handle->mQuickOrders |= mplite_bit(iLogsize);
+    handle->anFreeBlock[iLogsize]++;
+    if (++handle->anQuick[iLogsize] > handle->nQuickMax) {
+        mplite_quick_drain(handle, iLogsize);
+    }
+}
+
+/*
+ ** Take the last block freed off the non-empty quick list of order iLogsize
+ ** and return its index. The caller sets its control byte.
+ */
+static mplite_int_t mplite_quick_pop(mplite_t *handle, const int iLogsize)
+{
+    const mplite_int_t i = handle->aiQuick[iLogsize];
+
+    assert(handle->anQuick[iLogsize] > 0);
+    assert(handle->aCtrl[i] == (MPLITE_CTRL_QUICK | iLogsize));
+    handle->aiQuick[iLogsize] = *(mplite_int_t *) mplite_block(handle, i);
+    if (--handle->anQuick[iLogsize] == 0) {
+        handle->mQuickOrders &= ~mplite_bit(iLogsize);
+    }
+    handle->anFreeBlock[iLogsize]--;
+    return i;
+}
+
+/*
+ ** Coalesce every block on the quick list of order iLogsize.
+ */
+static void mplite_quick_drain(mplite_t *handle, const int iLogsize)
+{
+    while (handle->anQuick[iLogsize] > 0) {
+        mplite_merge(handle, mplite_quick_pop(handle, iLogsize), iLogsize);
+    }
+}
+
+/*
+ ** Coalesce every block on the quick lists.
+ */
+static void mplite_quick_flush(mplite_t *handle)
+{
+    while (handle->mQuickOrders != 0) {
+        mplite_quick_drain(handle, mplite_ctz_mask(handle->mQuickOrders));
+    }
+}
+
+/*
+ ** Give a pool a remote-free queue drained at nThreshold blocks and make
+ ** pOwner, the thread tag of its owner or NULL, the only thread whose
+ ** mplite_free takes the lock.
+ */
+static int mplite_remote_setup(mplite_t *handle, const int nThreshold,
+                               const void *pOwner)
+{
+    /* Check the parameters. The blocks of a shared pool are mapped at a
+     ** different address in each process.
+     */
+    if ((NULL == handle) || (nThreshold < 0) || (handle->pFile != NULL) ||
+        (!MPLITE_HAVE_ATOMICS)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    mplite_enter(handle);
+    handle->nRemoteMax = (nThreshold > 0) ? (uint32_t) nThreshold :
+            MPLITE_REMOTE_MAX;
+    handle->pOwner = pOwner;
+    mplite_leave(handle);
+
+    return MPLITE_OK;
+}
+
+#if MPLITE_HAVE_ATOMICS
+/*
+ ** Push the outstanding allocation p onto the remote-free queue of a pool
+ ** without taking its lock. The queue is a stack linked through the first
+ ** bytes of the blocks. Only the lock holder pops, and it takes the whole
+ ** stack at once, so there is no ABA problem.
+ **
+ ** A pool with an owner is only ever drained by the owner, on its next
+ ** allocation or once the queue reached the threshold on its next free, so
+ ** the pool needs no lock. The shards of a set have no owner. There the
+ ** thread that brings the count to the threshold drains the queue itself,
+ ** provided the shard has a lock to take. Otherwise the queue waits for the
+ ** next allocation from the shard.
+ */
+static void mplite_remote_push(mplite_t *handle, const void *p)
+{
+    void *pHead;
+    int bDrain;
+
+    /* Count the block before pushing it so that nRemote never falls short
+     ** of the blocks on the stack.
+     */
+    bDrain = (mplite_atomic_add(&handle->nRemote, 1) + 1 ==
+              handle->nRemoteMax) && (NULL == handle->pOwner) &&
+            ((handle->lockPolicy != MPLITE_POLICY_CALLBACK) ||
+             (handle->lock.acquire != NULL));
+    do {
+        pHead = mplite_atomic_load(&handle->pRemote);
+        *(void **) p = pHead;
+    } while (mplite_atomic_cas_ptr(&handle->pRemote, pHead, (void *) p) !=
+             pHead);
+
+    if (bDrain) {
+        mplite_enter(handle);
+        mplite_remote_drain(handle);
+        mplite_leave(handle);
+    }
+}
+#endif /* #if MPLITE_HAVE_ATOMICS */
+
+/*
+ ** Free every block on the remote-free queue. The caller holds the lock.
+ */
+static void mplite_remote_drain(mplite_t *handle)
+{
+    void *p;
+    uint32_t n = 0;
+
+#if MPLITE_HAVE_ATOMICS
+    p = mplite_atomic_xchg_ptr(&handle->pRemote, NULL);
+#else
+    p = handle->pRemote;
+    handle->pRemote = NULL;
+#endif /* #if MPLITE_HAVE_ATOMICS */
+    while (p != NULL) {
+        void *pNext = *(void **) p;
+
+        if (handle->pTrace != NULL) {
+            mplite_trace_add(handle, 0, p, NULL);
+        }
+        mplite_free_unsafe(handle, p);
+        p = pNext;
+        n++;
+    }
+#if MPLITE_HAVE_ATOMICS
+    mplite_atomic_add(&handle->nRemote, (uint32_t) 0 - n);
+#else
+    handle->nRemote -= n;
+#endif /* #if MPLITE_HAVE_ATOMICS */
+}
+
+/*
+ ** Return the pool or region that holds the allocation p. Regions are few, so
+ ** a linear search after the pool itself will do.
+ */
+static mplite_t *mplite_region(const mplite_t *handle, const void *p)
+{
+    int ii;
+
+    if ((handle->zPool <= (const uint8_t *) p) &&
+        ((const uint8_t *) p < handle->zPool + handle->nBlock *
+         handle->szAtom)) {
+        return (mplite_t *) handle;
+    }
+    for (ii = 0; ii < handle->nRegion; ii++) {
+        const mplite_t *pRegion = handle->apRegion[ii];
+        if ((pRegion->zPool <= (const uint8_t *) p) &&
+            ((const uint8_t *) p < pRegion->zPool + pRegion->nBlock *
+             pRegion->szAtom)) {
+            return (mplite_t *) pRegion;
+        }
+    }
+    return (mplite_t *) handle;
+}
+
+/*
+ ** Serve a request of nByte bytes aligned to nAlign, or not aligned if nAlign
+ ** is zero, that the pool itself could not from the first region that can.
+ ** Return NULL if none can. The caller counts the failure. The caller holds
+ ** the lock.
+ */
+static void *mplite_region_alloc(mplite_t *handle, const mplite_int_t nAlign,
+                                 const mplite_int_t nByte)
+{
+    int ii;
+
+    for (ii = 0; ii < handle->nRegion; ii++) {
+        mplite_t *pRegion = handle->apRegion[ii];
+        const uint64_t nFail = pRegion->nFail;
+        void *p = (0 == nAlign) ? mplite_malloc_unsafe(pRegion, nByte) :
+                mplite_memalign_unsafe(pRegion, nAlign, nByte);
+
+        pRegion->nFail = nFail;
+        if (p != NULL) {
+            mplite_peak(handle);
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ ** Change the order of the outstanding allocation p to iNewLog without moving
+ ** it. Return non-zero on success and zero if p has to be moved instead.
+ **
+ ** Shrinking always succeeds. The upper halves are split off one order at a
+ ** time and given back to the free lists. Their buddies are still checked out
+ ** so there is nothing to coalesce. Growing succeeds if p starts a block of
+ ** order iNewLog and every buddy to its right up to that order is a free block
+ ** of exactly its size. Those buddies are absorbed into p.
+ */
+static int mplite_resize_unsafe(mplite_t *handle, const void *p,
+                                const int iNewLog)
+{
+    mplite_int_t iBlock; /* Index of the block of p */
+    int iLogsize; /* Current order of the block */
+    int iLog;
+
+    /* Resize a block of a region in the region */
+    if (handle->nRegion > 0) {
+        mplite_t *pRegion = mplite_region(handle, p);
+        if (pRegion != handle) {
+            const int bResized = mplite_resize_unsafe(pRegion, p, iNewLog);
+            mplite_peak(handle);
+            return bResized;
+        }
+    }
+
+    iBlock = mplite_index(handle, p);
+    assert(iBlock >= 0 && iBlock < handle->nBlock);
+    assert((handle->aCtrl[iBlock] & MPLITE_CTRL_FREE) == 0);
+    iLogsize = handle->aCtrl[iBlock] & MPLITE_CTRL_LOGSIZE;
+
+    if (iNewLog < iLogsize) {
+        for (iLog = iLogsize - 1; iLog >= iNewLog; iLog--) {
+            mplite_int_t iBuddy = iBlock + mplite_pow2(iLog);
+            handle->aCtrl[iBuddy] = (uint8_t) (MPLITE_CTRL_FREE | iLog);
+            mplite_link(handle, iBuddy, iLog);
+            handle->anSplit[iLog + 1]++;
+        }
+        handle->currentOut -= (mplite_uint_t) (mplite_atom(handle) *
+                (mplite_pow2(iLogsize) - mplite_pow2(iNewLog)));
+    }
+    else if (iNewLog > iLogsize) {
+        if (((iBlock & (mplite_pow2(iNewLog) - 1)) != 0) ||
+            (iBlock + mplite_pow2(iNewLog) > handle->nBlock)) {
+            return 0;
+        }
+        for (iLog = iLogsize; iLog < iNewLog; iLog++) {
+            if (handle->aCtrl[iBlock + mplite_pow2(iLog)] !=
+                (MPLITE_CTRL_FREE | iLog)) {
+                return 0;
+            }
+        }
+        for (iLog = iLogsize; iLog < iNewLog; iLog++) {
+            mplite_int_t iBuddy = iBlock + mplite_pow2(iLog);
+            mplite_unlink(handle, iBuddy, iLog);
+            handle->aCtrl[iBuddy] = 0;
+            handle->anCoalesce[iLog + 1]++;
+        }
+        handle->currentOut += (mplite_uint_t) (mplite_atom(handle) *
+                (mplite_pow2(iNewLog) - mplite_pow2(iLogsize)));
+        mplite_peak(handle);
+    }
+    handle->aCtrl[iBlock] = (uint8_t) iNewLog;
+
+    return 1;
+}
+
+/*
+ ** Return the number of bits set in the free block bitmap of order iLogsize
+ ** below word iWord of level iLevel. Only words whose summary bit is set are
+ ** visited, since the others may hold stale bits.
+ */
+static mplite_int_t mplite_map_count(const mplite_t *handle,
+                                     const int iLogsize, const int iLevel,
+                                     const mplite_int_t iWord)
+{
+    uint64_t mWord = handle->aMap[handle->aMapOff[iLogsize][iLevel] + iWord];
+    mplite_int_t nBit = 0;
+
+    if (0 == iLevel) {
+        while (mWord != 0) {
+            mWord &= mWord - 1;
+            nBit++;
+        }
+        return nBit;
+    }
+    while (mWord != 0) {
+        nBit += mplite_map_count(handle, iLogsize, iLevel - 1,
+                                 iWord * 64 + mplite_ctz64(mWord));
+        mWord &= mWord - 1;
+    }
+    return nBit;
+}
+
+/*
+ ** Recount the free blocks of every order from the free block bitmaps, for a
+ ** pool whose bitmaps were changed by another handle.
+ */
+static void mplite_count_free(mplite_t *handle)
+{
+    int ii;
+
+    for (ii = 0; ii <= MPLITE_LOGMAX; ii++) {
+        handle->anFreeBlock[ii] = 0;
+        if ((handle->anMapDepth[ii] > 0) && (handle->aiFreelist[ii] >= 0)) {
+            handle->anFreeBlock[ii] = mplite_map_count(handle, ii,
+                    handle->anMapDepth[ii] - 1, 0);
+        }
+    }
+}
+
+/*
+ ** Clear the bits of the free block bitmap of order iLogsize below word iWord
+ ** of level iLevel that do not stand for a free block of that order, along
+ ** with the summary bits left over empty words. This brings back the bitmaps
+ ** of a pool whose last writer stopped in the middle of an update.
+ */
+static void mplite_map_repair(mplite_t *handle, const int iLogsize,
+                              const int iLevel, const mplite_int_t iWord)
+{
+    uint64_t *pWord = &handle->aMap[handle->aMapOff[iLogsize][iLevel] + iWord];
+    uint64_t mWord = *pWord;
+
+    while (mWord != 0) {
+        const int iBit = mplite_ctz64(mWord);
+        const mplite_int_t iChild = iWord * 64 + iBit;
+        int bKeep;
+
+        mWord &= mWord - 1;
+        if (0 == iLevel) {
+            const mplite_int_t i = iChild << iLogsize;
+            bKeep = ((i + mplite_pow2(iLogsize)) <= handle->nBlock) &&
+                    (handle->aCtrl[i] == (MPLITE_CTRL_FREE | iLogsize));
+        } else {
+            mplite_map_repair(handle, iLogsize, iLevel - 1, iChild);
+            bKeep = (handle->aMap[handle->aMapOff[iLogsize][iLevel - 1] +
+                    iChild] != 0);
+        }
+        if (!bKeep) {
+            *pWord &= ~((uint64_t) 1 << iBit);
+        }
+    }
+}
+
+/*
+ ** Return true if bit iBit is set in the free block bitmap of order iLogsize.
+ */
+static int mplite_map_test(const mplite_t *handle, const int iLogsize,
+                           const mplite_int_t iBit)
+{
+    const mplite_int_t *aOff = handle->aMapOff[iLogsize];
+    int iLevel;
+
+    for (iLevel = handle->anMapDepth[iLogsize] - 1; iLevel >= 0; iLevel--) {
+        uint64_t mWord = handle->aMap[aOff[iLevel] +
+                mplite_map_word(iBit, iLevel)];
+        if (0 == (mWord & ((uint64_t) 1 <<
+                (((uint64_t) iBit >> (6 * iLevel)) & 63)))) {
+            return 0;
+        }
+    }
+    return (handle->anMapDepth[iLogsize] > 0);
+}
+
+/*
+ ** Copy the statistics of a pool into a snapshot. This may race with the
+ ** lock holder, in which case the caller throws the copy away.
+ */
+static void mplite_stats_copy(const mplite_t *handle, mplite_stats_t *stats)
+{
+    int ii, jj;
+
+    memset(stats, 0, sizeof (*stats));
+    stats->szAtom = (uint64_t) handle->szAtom;
+    stats->nPoolBytes = (uint64_t) handle->nBlock * (uint64_t) handle->szAtom;
+    stats->nAlloc = handle->nAlloc;
+    stats->nFail = handle->nFail;
+    stats->totalAlloc = handle->totalAlloc;
+    stats->totalExcess = handle->totalExcess;
+    stats->currentOut = handle->currentOut;
+    stats->currentCount = handle->currentCount;
+    stats->maxOut = handle->maxOut;
+    stats->maxCount = handle->maxCount;
+    stats->maxRequest = handle->maxRequest;
+    stats->nLockAcquire = handle->nLockAcquire;
+    stats->nLockContended = handle->nLockContended;
+    stats->nLockWaitNs = handle->nLockWaitNs;
+    for (ii = 0; (ii <= MPLITE_LOGMAX) && (handle->anMapDepth[ii] > 0); ii++) {
+        stats->anAlloc[ii] = handle->anAlloc[ii];
+        stats->anFree[ii] = handle->anFree[ii];
+        stats->anSplit[ii] = handle->anSplit[ii];
+        stats->anCoalesce[ii] = handle->anCoalesce[ii];
+        stats->anFreeBlock[ii] = (uint64_t) handle->anFreeBlock[ii];
+    }
+    stats->nOrder = ii;
+
+    /* Add up the regions. The maxima and the failures are kept by the pool
+     ** for all of them. A copy that races with mplite_add_region may see a
+     ** region counted but not yet stored, and is thrown away anyway.
+     */
+    for (jj = 0; (jj < handle->nRegion) && (handle->apRegion[jj] != NULL);
+         jj++) {
+        const mplite_t *pRegion = handle->apRegion[jj];
+
+        stats->nPoolBytes += (uint64_t) pRegion->nBlock *
+                (uint64_t) pRegion->szAtom;
+        stats->nAlloc += pRegion->nAlloc;
+        stats->totalAlloc += pRegion->totalAlloc;
+        stats->totalExcess += pRegion->totalExcess;
+        stats->currentOut += pRegion->currentOut;
+        stats->currentCount += pRegion->currentCount;
+        for (ii = 0; (ii <= MPLITE_LOGMAX) && (pRegion->anMapDepth[ii] > 0);
+             ii++) {
+            stats->anAlloc[ii] += pRegion->anAlloc[ii];
+            stats->anFree[ii] += pRegion->anFree[ii];
+            stats->anSplit[ii] += pRegion->anSplit[ii];
+            stats->anCoalesce[ii] += pRegion->anCoalesce[ii];
+            stats->anFreeBlock[ii] += (uint64_t) pRegion->anFreeBlock[ii];
+        }
+        if (stats->nOrder < ii) {
+            stats->nOrder = ii;
+        }
+    }
+}
+
+/*
+ ** Append a record to the trace of a pool. pOld is the allocation passed in
+ ** and pNew the one handed out, either of which may be NULL. Called with the
+ ** lock held, so records are in the order the operations took effect.
+ */
+static void mplite_trace_add(mplite_t *handle, const mplite_int_t nSize,
+                             const void *pOld, const void *pNew)
+{
+    mplite_trace_t *trace = handle->pTrace;
+    mplite_trace_rec_t *pRec = &trace->aRec[trace->nTotal % trace->nRec];
+
+    pRec->iTime = mplite_clock() - trace->iStart;
+    pRec->nSize = (uint64_t) nSize;
+    pRec->iId = MPLITE_TRACE_NONE;
+    pRec->iNewId = MPLITE_TRACE_NONE;
+    if (pOld != NULL) {
+        pRec->iId = (uint64_t) mplite_index(handle, pOld);
+    }
+    if (pNew != NULL) {
+        pRec->iNewId = (uint64_t) mplite_index(handle, pNew);
+    }
+    trace->nTotal++;
+}
+
+/*
+ ** Append the NUL-terminated zLine to the text of *pnOut bytes in buf.
+ ** Return MPLITE_ERR_INVPAR if it does not fit.
+ */
+static int mplite_export_append(char *buf, const int buf_size, int *pnOut,
+                                const char *zLine)
+{
+    const int nLine = (int) strlen(zLine);
 
-    /* Keep track of the maximum allocation request.  Even unfulfilled
-     ** requests are counted */
-    if ((uint32_t) nByte > handle->maxRequest) {
-        handle->maxRequest = nByte;
+    if (*pnOut + nLine >= buf_size) {
+        return MPLITE_ERR_INVPAR;
     }
+    memcpy(&buf[*pnOut], zLine, nLine + 1);
+    *pnOut += nLine;
+    return MPLITE_OK;
+}
 
-    /* Abort if the requested allocation size is larger than the largest
-     ** power of two that we can represent using 32-bit signed integers.
-     */
-    if (nByte > MPLITE_MAX_ALLOC_SIZE) {
-        return NULL;
+/*
+ ** Return the index in set->apShard[] of the home shard of the calling thread.
+ **
+ ** Every thread draws a ticket the first time it gets here and keeps it in
+ ** thread-local storage. Handing out tickets round-robin spreads threads over
+ ** the shards evenly no matter how the system numbers its threads.
+ */
+static int mplite_set_home(const mplite_set_t *set)
+{
+    static volatile long nTicket = 0;
+    static MPLITE_TLS long iTicket = 0;
+
+#ifdef __linux__
+    if (set->affinity == MPLITE_AFFINITY_CPU) {
+        int iCpu = sched_getcpu();
+        if (iCpu >= 0) {
+            return iCpu % set->nShard;
+        }
+    }
+#endif /* #ifdef __linux__ */
+    if (iTicket == 0) {
+        iTicket = mplite_atomic_inc(&nTicket);
     }
+    return (int) ((unsigned long) (iTicket - 1) % (unsigned long) set->nShard);
+}
 
-    /* Round nByte up to the next valid power of two */
-    for (iFullSz = handle->szAtom, iLogsize = 0; iFullSz < nByte; iFullSz *= 2,
-        iLogsize++) {
+/*
+ ** Refill the empty magazine of order iLogsize with up to cache->nBatch blocks
+ ** taken from the pool under a single lock acquisition. Return one more block
+ ** to the caller, or NULL if the pool has no block of that size left.
+ **
+ ** The blocks are queued in the order the pool hands them out, so the cache
+ ** keeps the lowest-address-first placement of the underlying allocator.
+ */
+static void *mplite_tcache_refill(mplite_tcache_t *cache, const int iLogsize)
+{
+    mplite_t *handle = cache->pool;
+    const mplite_int_t nByte = mplite_atom(handle) << iLogsize;
+    void **ppTail = &cache->apMagazine[iLogsize];
+    void *apChunk[16]; /* Blocks taken from the pool in one go */
+    void *p = NULL;
+    int nWant = cache->nBatch + 1; /* The caller's block and the magazine */
+    int n = 0;
+
+    assert(cache->apMagazine[iLogsize] == NULL);
+    mplite_enter(handle);
+    while (n < nWant) {
+        int nChunk = nWant - n;
+        int nGot, ii;
+
+        if (nChunk > (int) (sizeof (apChunk) / sizeof (apChunk[0]))) {
+            nChunk = (int) (sizeof (apChunk) / sizeof (apChunk[0]));
+        }
+        nGot = mplite_malloc_batch_unsafe(handle, nByte, nChunk, apChunk);
+        for (ii = 0; ii < nGot; ii++, n++) {
+            if (0 == n) {
+                p = apChunk[ii];
+            }
+            else {
+                *ppTail = apChunk[ii];
+                ppTail = (void **) apChunk[ii];
+            }
+        }
+        if (nGot < nChunk) {
+            break;
+        }
     }
+    mplite_leave(handle);
+    *ppTail = NULL;
+    cache->anMagazine[iLogsize] = (n > 0) ? n - 1 : 0;
 
-    /* Make sure handle->aiFreelist[iLogsize] contains at least one free
-     ** block.  If not, then split a block of the next larger power of
-     ** two in order to create a new free block of size iLogsize.
-     */
-    for (iBin = iLogsize; handle->aiFreelist[iBin] < 0 && iBin <= MPLITE_LOGMAX;
-        iBin++) {
+    return p;
+}
+
+/*
+ ** Return the first nDrain blocks of the magazine of order iLogsize to the
+ ** pool under a single lock acquisition.
+ */
+static void mplite_tcache_drain(mplite_tcache_t *cache, const int iLogsize,
+                                int nDrain)
+{
+    mplite_t *handle = cache->pool;
+    void *p = cache->apMagazine[iLogsize];
+
+    assert(nDrain <= cache->anMagazine[iLogsize]);
+    cache->anMagazine[iLogsize] -= nDrain;
+#if MPLITE_HAVE_ATOMICS
+    /* Leave the blocks to the owner of the pool, if there is one */
+    if (mplite_remote_caller(handle)) {
+        while (nDrain-- > 0) {
+            void *pNext = *(void **) p;
+            mplite_remote_push(handle, p);
+            p = pNext;
+        }
+        cache->apMagazine[iLogsize] = p;
+        return;
     }
-    if (iBin > MPLITE_LOGMAX) {
-        return NULL;
+#endif /* #if MPLITE_HAVE_ATOMICS */
+    mplite_enter(handle);
+    while (nDrain-- > 0) {
+        void *pNext = *(void **) p;
+        mplite_free_unsafe(handle, p);
+        p = pNext;
     }
-    i = mplite_unlink_first(handle, iBin);
-    while (iBin > iLogsize) {
-        int newSize;
+    mplite_leave(handle);
+    cache->apMagazine[iLogsize] = p;
+}
 
-        iBin--;
-        newSize = 1 << iBin;
-        handle->aCtrl[i + newSize] = (uint8_t) (MPLITE_CTRL_FREE | iBin);
-        mplite_link(handle, i + newSize, iBin);
+/*
+ ** Return the smallest size class of the slab front-end that holds nByte
+ ** bytes or -1 if nByte is larger than every class.
+ */
+static int mplite_slab_class(const mplite_slab_t *slab,
+                             const mplite_int_t nByte)
+{
+    int iClass;
+
+    for (iClass = 0; iClass < slab->nClass; iClass++) {
+        if (nByte <= slab->anSize[iClass]) {
+            return iClass;
+        }
     }
-    handle->aCtrl[i] = (uint8_t) iLogsize;
+    return -1;
+}
 
-    /* Update allocator performance statistics. */
-    handle->nAlloc++;
-    handle->totalAlloc += iFullSz;
-    handle->totalExcess += iFullSz - nByte;
-    handle->currentCount++;
-    handle->currentOut += iFullSz;
-    if (handle->maxCount < handle->currentCount) {
-        handle->maxCount = handle->currentCount;
+/*
+ ** Check out the lowest free slot of the first slab of class iClass with free
+ ** slots, carving a new slab out of the pool if there is none. Return NULL if
+ ** the pool has no room for a new slab.
+ **
+ ** The caller holds the pool lock.
+ */
+static void *mplite_slab_get(mplite_slab_t *slab, const int iClass)
+{
+    mplite_t *handle = slab->pool;
+    mplite_t *pPool; /* Pool or region that holds a new slab */
+    mplite_slab_page_t *pPage = (mplite_slab_page_t *) slab->apPartial[iClass];
+    int iWord;
+    int iSlot;
+
+    if (NULL == pPage) {
+        const int nSlot = slab->anSlot[iClass];
+        mplite_int_t iSlab;
+
+        pPage = (mplite_slab_page_t *) mplite_malloc_unsafe(handle,
+                                                             slab->szSlab);
+        if (NULL == pPage) {
+            return NULL;
+        }
+        pPool = mplite_region(handle, pPage);
+        iSlab = mplite_index(pPool, pPage);
+        assert(pPool->aCtrl[iSlab] == slab->iSlabLog);
+        pPool->aCtrl[iSlab] |= MPLITE_CTRL_SLAB;
+        slab->nSlab++;
+
+        pPage->pNext = NULL;
+        pPage->pPrev = NULL;
+        pPage->iClass = iClass;
+        pPage->nFree = nSlot;
+        for (iWord = 0; iWord < nSlot / 64; iWord++) {
+            pPage->aFree[iWord] = ~(uint64_t) 0;
+        }
+        if ((nSlot & 63) != 0) {
+            pPage->aFree[iWord] = ((uint64_t) 1 << (nSlot & 63)) - 1;
+        }
+        slab->apPartial[iClass] = pPage;
     }
-    if (handle->maxOut < handle->currentOut) {
-        handle->maxOut = handle->currentOut;
+
+    assert(pPage->nFree > 0);
+    iWord = 0;
+    while (pPage->aFree[iWord] == 0) {
+        iWord++;
+    }
+    iSlot = iWord * 64 + mplite_ctz64(pPage->aFree[iWord]);
+    pPage->aFree[iWord] &= pPage->aFree[iWord] - 1;
+
+    /* A full slab leaves the list of slabs with free slots */
+    if (--pPage->nFree == 0) {
+        slab->apPartial[iClass] = pPage->pNext;
+        if (pPage->pNext != NULL) {
+            pPage->pNext->pPrev = NULL;
+        }
     }
 
-    /* Return a pointer to the allocated memory. */
-    return (void*) &handle->zPool[i * handle->szAtom];
+    slab->currentOut += slab->anSize[iClass];
+    slab->currentCount++;
+
+    return (uint8_t *) pPage + slab->anOffset[iClass] +
+            (mplite_int_t) iSlot * slab->anSize[iClass];
 }
 
 /*
- ** Free an outstanding memory allocation.
+ ** Return the slot p to its slab pPage. A slab whose slots are all free goes
+ ** back to the pool.
+ **
+ ** The caller holds the pool lock.
  */
-static void mplite_free_unsafe(mplite_t *handle, const void *pOld)
+static void mplite_slab_put(mplite_slab_t *slab, mplite_slab_page_t *pPage,
+                            const void *p)
 {
-    uint32_t size, iLogsize;
-    int iBlock;
+    mplite_t *handle = slab->pool;
+    mplite_t *pPool; /* Pool or region that holds pPage */
+    const int iClass = pPage->iClass;
+    const int iSlot = (int) (((const uint8_t *) p - (uint8_t *) pPage -
+            slab->anOffset[iClass]) / slab->anSize[iClass]);
+
+    assert(iClass >= 0 && iClass < slab->nClass);
+    assert(iSlot >= 0 && iSlot < slab->anSlot[iClass]);
+    assert((pPage->aFree[iSlot / 64] & ((uint64_t) 1 << (iSlot & 63))) == 0);
+
+    pPage->aFree[iSlot / 64] |= (uint64_t) 1 << (iSlot & 63);
+    slab->currentOut -= slab->anSize[iClass];
+    slab->currentCount--;
+
+    /* A full slab that gets a free slot rejoins the list */
+    if (pPage->nFree++ == 0) {
+        pPage->pPrev = NULL;
+        pPage->pNext = (mplite_slab_page_t *) slab->apPartial[iClass];
+        if (pPage->pNext != NULL) {
+            pPage->pNext->pPrev = pPage;
+        }
+        slab->apPartial[iClass] = pPage;
+    }
 
-    /* Set iBlock to the index of the block pointed to by pOld in
-     ** the array of handle->szAtom byte blocks pointed to by handle->zPool.
+    if (pPage->nFree == slab->anSlot[iClass]) {
+        if (pPage->pPrev != NULL) {
+            pPage->pPrev->pNext = pPage->pNext;
+        }
+        else {
+            slab->apPartial[iClass] = pPage->pNext;
+        }
+        if (pPage->pNext != NULL) {
+            pPage->pNext->pPrev = pPage->pPrev;
+        }
+        pPool = mplite_region(handle, pPage);
+        pPool->aCtrl[mplite_index(pPool, pPage)] &=
+                (uint8_t) ~MPLITE_CTRL_SLAB;
+        slab->nSlab--;
+        mplite_free_unsafe(handle, pPage);
+    }
+}
+
+/*
+ ** Create the file or shared memory object at path with nFile bytes, map it
+ ** and lay out a header followed by a fresh pool in it.
+ */
+static int mplite_file_create(mplite_t *handle, const char *path,
+                              const int bShared, const mplite_int_t nFile,
+                              const int min_alloc, const mplite_lock_t *lock)
+{
+    mplite_file_header_t *pHdr;
+    mplite_int_t nMap = nFile;
+    void *pMap;
+    int rc;
+
+    pMap = mplite_file_map(path, bShared, 1, &nMap);
+    if (NULL == pMap) {
+        return MPLITE_ERR_FILE;
+    }
+    rc = mplite_init(handle, (uint8_t *) pMap + MPLITE_FILE_HEADER,
+                     nFile - MPLITE_FILE_HEADER, min_alloc, lock);
+    if (rc != MPLITE_OK) {
+        mplite_file_unmap(pMap, nFile);
+        return rc;
+    }
+    assert(handle->zPool == (uint8_t *) pMap + MPLITE_FILE_HEADER);
+
+    pHdr = (mplite_file_header_t *) pMap;
+    memset(pHdr, 0, sizeof (*pHdr));
+    pHdr->magic = MPLITE_FILE_MAGIC;
+    pHdr->version = MPLITE_FILE_VERSION;
+    pHdr->szInt = (uint32_t) sizeof (mplite_int_t);
+    pHdr->nLogmax = MPLITE_LOGMAX;
+    pHdr->nFile = nFile;
+    pHdr->szAtom = handle->szAtom;
+    pHdr->nBlock = handle->nBlock;
+    pHdr->iMapOff = (uint8_t *) handle->aMap - handle->zPool;
+    pHdr->iCtrlOff = handle->aCtrl - handle->zPool;
+    handle->pFile = pMap;
+
+    if (bShared) {
+#ifdef _WIN32
+        assert(0);
+#else
+        pthread_mutexattr_t attr;
+
+        if ((pthread_mutexattr_init(&attr) != 0) ||
+            (pthread_mutexattr_setpshared(&attr,
+                                          PTHREAD_PROCESS_SHARED) != 0) ||
+            (pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0) ||
+            (pthread_mutex_init(&pHdr->mutex, &attr) != 0)) {
+            mplite_file_unmap(pMap, nFile);
+            memset(handle, 0, sizeof (*handle));
+            return MPLITE_ERR_FILE;
+        }
+        pthread_mutexattr_destroy(&attr);
+        pHdr->bShared = 1;
+        pHdr->nRef = 1;
+        mplite_file_save(handle, pHdr);
+
+        handle->lock.arg = handle;
+        handle->lock.acquire = mplite_shm_acquire;
+        handle->lock.release = mplite_shm_release;
+#endif /* #ifdef _WIN32 */
+    }
+
+    return MPLITE_OK;
+}
+
+/*
+ ** Map the whole file or shared memory object at path and check that it holds
+ ** a pool laid out by a build of the library with the same layout, of the
+ ** shared kind if bShared is true. Set up the geometry and the pointers of
+ ** handle but not the state kept in the header.
+ */
+static int mplite_file_open(mplite_t *handle, const char *path,
+                            const int bShared)
+{
+    const mplite_file_header_t *pHdr;
+    mplite_int_t nMap = 0;
+    mplite_int_t nWord;
+    void *pMap;
+
+    pMap = mplite_file_map(path, bShared, 0, &nMap);
+    if (NULL == pMap) {
+        return MPLITE_ERR_FILE;
+    }
+    pHdr = (const mplite_file_header_t *) pMap;
+
+    memset(handle, 0, sizeof (*handle));
+    if ((nMap > MPLITE_FILE_HEADER) && (pHdr->magic == MPLITE_FILE_MAGIC) &&
+        (pHdr->version == MPLITE_FILE_VERSION) &&
+        (pHdr->szInt == sizeof (mplite_int_t)) &&
+        (pHdr->nLogmax == MPLITE_LOGMAX) &&
+        (pHdr->bShared == (uint32_t) (bShared != 0)) &&
+        (pHdr->nFile == nMap) && mplite_atom_valid(pHdr->szAtom) &&
+        (pHdr->nBlock > 0) &&
+        (pHdr->iCtrlOff + pHdr->nBlock <= nMap - MPLITE_FILE_HEADER)) {
+        handle->szAtom = (mplite_int_t) pHdr->szAtom;
+        handle->nBlock = (mplite_int_t) pHdr->nBlock;
+        nWord = mplite_map_layout(handle, handle->nBlock);
+        if ((pHdr->iMapOff >= handle->nBlock * handle->szAtom) &&
+            (pHdr->iMapOff + nWord * (int64_t) sizeof (uint64_t) ==
+             pHdr->iCtrlOff)) {
+            handle->zPool = (uint8_t *) pMap + MPLITE_FILE_HEADER;
+            handle->aMap = (uint64_t *) (handle->zPool + pHdr->iMapOff);
+            handle->aCtrl = handle->zPool + pHdr->iCtrlOff;
+            handle->pFile = pMap;
+            return MPLITE_OK;
+        }
+    }
+
+    mplite_file_unmap(pMap, nMap);
+    memset(handle, 0, sizeof (*handle));
+    return MPLITE_ERR_FILE;
+}
+
+/*
+ ** Copy the state that mplite_t keeps outside of the pool from the header of
+ ** a pool file to handle.
+ */
+static void mplite_file_load(mplite_t *handle,
+                             const mplite_file_header_t *pHdr)
+{
+    int ii;
+
+    for (ii = 0; ii <= MPLITE_LOGMAX; ii++) {
+        handle->aiFreelist[ii] = (mplite_int_t) pHdr->aiFreelist[ii];
+    }
+    handle->mFreeOrders = (mplite_mask_t) pHdr->mFreeOrders;
+    handle->nAlloc = pHdr->nAlloc;
+    handle->totalAlloc = pHdr->totalAlloc;
+    handle->totalExcess = pHdr->totalExcess;
+    handle->currentOut = (mplite_uint_t) pHdr->currentOut;
+    handle->currentCount = (mplite_uint_t) pHdr->currentCount;
+    handle->maxOut = (mplite_uint_t) pHdr->maxOut;
+    handle->maxCount = (mplite_uint_t) pHdr->maxCount;
+    handle->maxRequest = (mplite_uint_t) pHdr->maxRequest;
+}
+
+/*
+ ** Copy the state that mplite_t keeps outside of the pool from handle to the
+ ** header of a pool file.
+ */
+static void mplite_file_save(const mplite_t *handle,
+                             mplite_file_header_t *pHdr)
+{
+    int ii;
+
+    for (ii = 0; ii <= MPLITE_LOGMAX; ii++) {
+        pHdr->aiFreelist[ii] = handle->aiFreelist[ii];
+    }
+    pHdr->mFreeOrders = handle->mFreeOrders;
+    pHdr->nAlloc = handle->nAlloc;
+    pHdr->totalAlloc = handle->totalAlloc;
+    pHdr->totalExcess = handle->totalExcess;
+    pHdr->currentOut = handle->currentOut;
+    pHdr->currentCount = handle->currentCount;
+    pHdr->maxOut = handle->maxOut;
+    pHdr->maxCount = handle->maxCount;
+    pHdr->maxRequest = handle->maxRequest;
+}
+
+/*
+ ** Rebuild the free lists of a shared pool whose last lock holder died. The
+ ** bitmaps and aCtrl live in the segment and were changed as the dead process
+ ** went, while the heads of the free lists in the header were only written
+ ** back when it released the lock, so they may name blocks it handed out.
+ ** Drop every bit that aCtrl does not mark free of its order and every free
+ ** mark that has no bit, then take the heads and the counts of free blocks
+ ** again from what is left.
+ */
+static void mplite_file_recover(mplite_t *handle)
+{
+    mplite_int_t i;
+    int ii;
+
+    for (ii = 0; ii <= MPLITE_LOGMAX; ii++) {
+        if (handle->anMapDepth[ii] > 0) {
+            mplite_map_repair(handle, ii, handle->anMapDepth[ii] - 1, 0);
+        }
+    }
+
+    /* A block taken off the bitmaps but not yet marked checked out is lost.
+     ** Mark it checked out so that freeing its buddy does not merge with it.
      */
-    iBlock = ((uint8_t *) pOld - handle->zPool) / handle->szAtom;
+    for (i = 0; i < handle->nBlock; i++) {
+        const int iLogsize = handle->aCtrl[i] & MPLITE_CTRL_LOGSIZE;
+        if (((handle->aCtrl[i] & MPLITE_CTRL_QUICK) == MPLITE_CTRL_FREE) &&
+                (((i & (mplite_pow2(iLogsize) - 1)) != 0) ||
+                 !mplite_map_test(handle, iLogsize, i >> iLogsize))) {
+            handle->aCtrl[i] &= (uint8_t) ~MPLITE_CTRL_FREE;
+        }
+    }
 
-    /* Check that the pointer pOld points to a valid, non-free block. */
-    assert(iBlock >= 0 && iBlock < handle->nBlock);
-    assert(((uint8_t *) pOld - handle->zPool) % handle->szAtom == 0);
-    assert((handle->aCtrl[iBlock] & MPLITE_CTRL_FREE) == 0);
+    handle->mFreeOrders = 0;
+    for (ii = 0; ii <= MPLITE_LOGMAX; ii++) {
+        const mplite_int_t iFirst = (handle->anMapDepth[ii] > 0) ?
+                mplite_map_first(handle, ii) : -1;
+        handle->aiFreelist[ii] = (iFirst < 0) ? -1 : (iFirst << ii);
+        if (iFirst >= 0) {
+            handle->mFreeOrders |= mplite_bit(ii);
+        }
+    }
+    mplite_count_free(handle);
+}
 
-    iLogsize = handle->aCtrl[iBlock] & MPLITE_CTRL_LOGSIZE;
-    size = 1 << iLogsize;
-    assert(iBlock + size - 1 < (uint32_t) handle->nBlock);
+/*
+ ** Lock callbacks of a shared pool. The header of the segment holds the
+ ** state of the pool, and every process brings its own mplite_t up to date
+ ** when it takes the lock and publishes its changes before releasing it.
+ **
+ ** If the process holding the lock died, the lock is taken over and the free
+ ** lists are rebuilt from the bitmaps before the header is published again,
+ ** so that no block is handed out twice. The blocks the dead process was
+ ** working on may leak, and the checkout statistics may be off by them.
+ */
+static int mplite_shm_acquire(void *arg)
+{
+#ifdef _WIN32
+    MPLITE_UNUSED_PARAM(arg);
+    return -1;
+#else
+    mplite_t *handle = (mplite_t *) arg;
+    mplite_file_header_t *pHdr = (mplite_file_header_t *) handle->pFile;
+    int rc = pthread_mutex_lock(&pHdr->mutex);
+
+    if (EOWNERDEAD == rc) {
+        rc = pthread_mutex_consistent(&pHdr->mutex);
+        if (0 == rc) {
+            mplite_file_load(handle, pHdr);
+            mplite_file_recover(handle);
+            mplite_file_save(handle, pHdr);
+            return 0;
+        }
+    }
+    mplite_file_load(handle, pHdr);
+    return rc;
+#endif /* #ifdef _WIN32 */
+}
 
-    handle->aCtrl[iBlock] |= MPLITE_CTRL_FREE;
-    handle->aCtrl[iBlock + size - 1] |= MPLITE_CTRL_FREE;
-    assert(handle->currentCount > 0);
-    assert(handle->currentOut >= (size * handle->szAtom));
-    handle->currentCount--;
-    handle->currentOut -= size * handle->szAtom;
-    assert(handle->currentOut > 0 || handle->currentCount == 0);
-    assert(handle->currentCount > 0 || handle->currentOut == 0);
+static int mplite_shm_release(void *arg)
+{
+#ifdef _WIN32
+    MPLITE_UNUSED_PARAM(arg);
+    return -1;
+#else
+    mplite_t *handle = (mplite_t *) arg;
+    mplite_file_header_t *pHdr = (mplite_file_header_t *) handle->pFile;
+
+    mplite_file_save(handle, pHdr);
+    return pthread_mutex_unlock(&pHdr->mutex);
+#endif /* #ifdef _WIN32 */
+}
 
-    handle->aCtrl[iBlock] = (uint8_t) (MPLITE_CTRL_FREE | iLogsize);
-    while (iLogsize < MPLITE_LOGMAX) {
-        int iBuddy;
-        if ((iBlock >> iLogsize) & 1) {
-            iBuddy = iBlock - size;
+/*
+ ** Map the file at path into memory, shared with the file. If bShared is
+ ** true path names a POSIX shared memory object instead. If bCreate is true
+ ** the file is created, or truncated, to *pnMap bytes. Otherwise the whole
+ ** file is mapped and its size stored in *pnMap. Return the address of the
+ ** mapping or NULL on failure.
+ */
+static void *mplite_file_map(const char *path, const int bShared,
+                             const int bCreate, mplite_int_t *pnMap)
+{
+    void *pMap;
+#ifdef _WIN32
+    HANDLE hFile;
+    HANDLE hMap;
+    LARGE_INTEGER nSize;
+
+    /* Shared memory objects are not available */
+    if (bShared) {
+        return NULL;
+    }
+    hFile = CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                        bCreate ? CREATE_ALWAYS : OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == hFile) {
+        return NULL;
+    }
+    if (!bCreate) {
+        if (!GetFileSizeEx(hFile, &nSize) || (nSize.QuadPart <= 0) ||
+            ((uint64_t) nSize.QuadPart >
+             ((mplite_uint_t) ~(mplite_uint_t) 0 >> 1))) {
+            CloseHandle(hFile);
+            return NULL;
         }
-        else {
-            iBuddy = iBlock + size;
+        *pnMap = (mplite_int_t) nSize.QuadPart;
+    }
+    hMap = CreateFileMappingA(hFile, NULL, PAGE_READWRITE,
+                              (DWORD) ((uint64_t) *pnMap >> 32),
+                              (DWORD) ((uint64_t) *pnMap & 0xffffffff), NULL);
+    CloseHandle(hFile);
+    if (NULL == hMap) {
+        return NULL;
+    }
+    /* The view keeps the mapping and the file open */
+    pMap = MapViewOfFile(hMap, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T) *pnMap);
+    CloseHandle(hMap);
+#else
+    const int flags = bCreate ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR;
+    struct stat st;
+    int fd;
+
+    fd = bShared ? shm_open(path, flags, 0600) : open(path, flags, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (bCreate) {
+        if (ftruncate(fd, (off_t) *pnMap) != 0) {
+            close(fd);
+            return NULL;
         }
-        assert(iBuddy >= 0);
-        if ((iBuddy + (1 << iLogsize)) > handle->nBlock) break;
-        if (handle->aCtrl[iBuddy] != (MPLITE_CTRL_FREE | iLogsize)) break;
-        mplite_unlink(handle, iBuddy, iLogsize);
-        iLogsize++;
-        if (iBuddy < iBlock) {
-            handle->aCtrl[iBuddy] = (uint8_t) (MPLITE_CTRL_FREE | iLogsize);
-            handle->aCtrl[iBlock] = 0;
-            iBlock = iBuddy;
+    }
+    else {
+        if ((fstat(fd, &st) != 0) || (st.st_size <= 0) ||
+            ((uint64_t) st.st_size >
+             ((mplite_uint_t) ~(mplite_uint_t) 0 >> 1))) {
+            close(fd);
+            return NULL;
+        }
+        *pnMap = (mplite_int_t) st.st_size;
+    }
+    /* The mapping keeps the file open */
+    pMap = mmap(NULL, (size_t) *pnMap, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                0);
+    close(fd);
+    if (MAP_FAILED == pMap) {
+        pMap = NULL;
+    }
+#endif /* #ifdef _WIN32 */
+
+    return pMap;
+}
+
+/*
+ ** Write the first nByte bytes of the mapping pMap to its file. Return zero on
+ ** success.
+ */
+static int mplite_file_sync(void *pMap, const mplite_int_t nByte)
+{
+#ifdef _WIN32
+    return FlushViewOfFile(pMap, (SIZE_T) nByte) ? 0 : -1;
+#else
+    return msync(pMap, (size_t) nByte, MS_SYNC);
+#endif /* #ifdef _WIN32 */
+}
+
+/*
+ ** Release a mapping of nByte bytes made by mplite_file_map().
+ */
+static void mplite_file_unmap(void *pMap, const mplite_int_t nByte)
+{
+#ifdef _WIN32
+    MPLITE_UNUSED_PARAM(nByte);
+    UnmapViewOfFile(pMap);
+#else
+    munmap(pMap, (size_t) nByte);
+#endif /* #ifdef _WIN32 */
+}
+
+/*
+ ** Monotonic clock in nanoseconds, used to time waits for a built-in lock and
+ ** to stamp trace records
+ */
+static uint64_t mplite_clock(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER iFreq;
+    LARGE_INTEGER iNow;
+
+    QueryPerformanceFrequency(&iFreq);
+    QueryPerformanceCounter(&iNow);
+    return (uint64_t) iNow.QuadPart / (uint64_t) iFreq.QuadPart * 1000000000 +
+            (uint64_t) iNow.QuadPart % (uint64_t) iFreq.QuadPart * 1000000000 /
+            (uint64_t) iFreq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#endif /* #ifdef _WIN32 */
+}
+
+#if MPLITE_HAVE_ATOMICS
+/*
+ ** Back off after a failed attempt to take a built-in lock. Spin through an
+ ** exponentially growing number of pause instructions at first, and yield the
+ ** CPU on every call once the wait gets long.
+ */
+static void mplite_backoff(int *pnSpin)
+{
+    int ii;
+
+    if (*pnSpin > MPLITE_SPIN_MAX) {
+        mplite_yield();
+        return;
+    }
+    for (ii = 0; ii < *pnSpin; ii++) {
+        mplite_pause();
+    }
+    *pnSpin <<= 1;
+}
+
+/*
+ ** Wait for a test-and-test-and-set spinlock. Waiters only read the lock word
+ ** until it looks free, so its cache line stays shared while the holder works.
+ */
+static void mplite_spin_wait(volatile uint32_t *aWord)
+{
+    int nSpin = 1;
+
+    do {
+        do {
+            mplite_backoff(&nSpin);
+        } while (mplite_atomic_load(&aWord[0]) != 0);
+    } while (mplite_atomic_xchg(&aWord[0], 1) != 0);
+}
+
+/*
+ ** Wait for a futex-based mutex. aWord[0] is 0 when the mutex is free, 1 when
+ ** it is held and 2 when it is held and may have sleeping waiters. A waiter
+ ** spins for a while first, since the critical sections are short, and then
+ ** sleeps in the kernel. Without futexes it yields the CPU instead.
+ */
+static void mplite_futex_wait(volatile uint32_t *aWord)
+{
+    int nSpin = 1;
+
+    while (nSpin <= MPLITE_SPIN_MAX) {
+        mplite_backoff(&nSpin);
+        if ((mplite_atomic_load(&aWord[0]) == 0) &&
+            (mplite_atomic_cas(&aWord[0], 0, 1) == 0)) {
+            return;
+        }
+    }
+    while (mplite_atomic_xchg(&aWord[0], 2) != 0) {
+#ifdef __linux__
+        syscall(SYS_futex, &aWord[0], FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+#else
+        mplite_yield();
+#endif /* #ifdef __linux__ */
+    }
+}
+
+/*
+ ** Release a futex-based mutex that may have sleeping waiters and wake one of
+ ** them.
+ */
+static void mplite_futex_wake(volatile uint32_t *aWord)
+{
+    mplite_atomic_store(&aWord[0], 0);
+#ifdef __linux__
+    syscall(SYS_futex, &aWord[0], FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif /* #ifdef __linux__ */
+}
+
+/*
+ ** Wait for ticket iTicket of a ticket lock to be served. aWord[0] is the next
+ ** ticket to hand out and aWord[1] the ticket being served. Only the next
+ ** waiter in line spins. The others yield the CPU, so that a waiter ahead of
+ ** them that got preempted can take its turn without delay.
+ */
+static void mplite_ticket_wait(volatile uint32_t *aWord,
+                               const uint32_t iTicket)
+{
+    int nSpin = 1;
+    uint32_t nAhead;
+
+    while ((nAhead = iTicket - mplite_atomic_load(&aWord[1])) != 0) {
+        if (nAhead > 1) {
+            mplite_yield();
         }
         else {
-            handle->aCtrl[iBlock] = (uint8_t) (MPLITE_CTRL_FREE | iLogsize);
-            handle->aCtrl[iBuddy] = 0;
+            mplite_backoff(&nSpin);
         }
-        size *= 2;
     }
-    mplite_link(handle, iBlock, iLogsize);
 }
+#endif /* #if MPLITE_HAVE_ATOMICS */
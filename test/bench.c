@@ -0,0 +1,421 @@
+/*
+ * Micro-benchmark of the mplite allocator against the system malloc.
+ *
+ * Every workload runs twice per allocator: once untimed per operation to get
+ * the mean cost of an operation, and once with each operation timed on its
+ * own to get the latency percentiles. The percentiles include the cost of
+ * reading the clock, which is printed first so that it can be discounted.
+ *
+ * Usage: bench [operations per workload]
+ *
+ * Each result is printed on one line of key=value pairs so that runs can be
+ * compared with a script.
+ */
+#include "mplite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif /* #ifdef _WIN32 */
+
+#define BENCH_OPS_DEFAULT    200000
+#define BENCH_SLOTS_MIN      2
+#define BENCH_SLOTS_MAX      4096
+#define BENCH_ZIPF_SIZES     64
+
+/* Order in which a full working set is freed */
+typedef enum bench_order {
+    BENCH_LIFO,
+    BENCH_FIFO,
+    BENCH_RANDOM
+} bench_order_t;
+
+/* Distribution of the request sizes */
+typedef enum bench_mix {
+    BENCH_FIXED, /* Always the minimum size of the workload */
+    BENCH_UNIFORM, /* Uniform between the minimum and maximum sizes */
+    BENCH_ZIPF, /* Zipf with s = 1 over multiples of the minimum size */
+    BENCH_REALLOC /* Grown by a quarter at a time up to the maximum size */
+} bench_mix_t;
+
+typedef struct bench_workload {
+    const char *name;
+    bench_mix_t mix;
+    bench_order_t order;
+    int min_size;
+    int max_size;
+} bench_workload_t;
+
+/* Allocator under test */
+typedef struct bench_alloc {
+    const char *name;
+    void *(*malloc_fn)(void *ctx, int size);
+    void (*free_fn)(void *ctx, void *p);
+    void *(*realloc_fn)(void *ctx, void *p, int size);
+    void *ctx;
+} bench_alloc_t;
+
+typedef struct bench_result {
+    double ns_per_op;
+    unsigned long p50;
+    unsigned long p99;
+    unsigned long p999;
+    unsigned long fails;
+} bench_result_t;
+
+static const bench_workload_t workloads[] = {
+    {"fixed64-lifo", BENCH_FIXED, BENCH_LIFO, 64, 64},
+    {"fixed64-fifo", BENCH_FIXED, BENCH_FIFO, 64, 64},
+    {"fixed64-random", BENCH_FIXED, BENCH_RANDOM, 64, 64},
+    {"uniform-random", BENCH_UNIFORM, BENCH_RANDOM, 16, 4096},
+    {"zipf-lifo", BENCH_ZIPF, BENCH_LIFO, 16, 16 * BENCH_ZIPF_SIZES},
+    {"zipf-random", BENCH_ZIPF, BENCH_RANDOM, 16, 16 * BENCH_ZIPF_SIZES},
+    {"realloc-growth", BENCH_REALLOC, BENCH_FIFO, 16, 65536}
+};
+
+static const int pool_sizes[] = {1 << 20, 16 << 20, 128 << 20};
+static const int min_allocs[] = {16, 64};
+
+static unsigned long long rng_state = 88172645463325252ULL;
+static unsigned long zipf_cdf[BENCH_ZIPF_SIZES];
+
+/* Clock in nanoseconds */
+static unsigned long long bench_now(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (0 == freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (unsigned long long) (now.QuadPart * 1000000000.0 / freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif /* #ifdef _WIN32 */
+}
+
+/* xorshift64, so that every allocator sees the same sequence */
+static unsigned long bench_rand(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned long) (rng_state >> 33);
+}
+
+static void zipf_setup(void)
+{
+    double sum = 0.0;
+    double total = 0.0;
+    int i;
+
+    for (i = 0; i < BENCH_ZIPF_SIZES; i++) {
+        total += 1.0 / (i + 1);
+    }
+    for (i = 0; i < BENCH_ZIPF_SIZES; i++) {
+        sum += 1.0 / (i + 1);
+        zipf_cdf[i] = (unsigned long) (sum / total * 0x7fffffffUL);
+    }
+}
+
+static int bench_size(const bench_workload_t *w)
+{
+    unsigned long r;
+    int lo;
+    int hi;
+
+    switch (w->mix) {
+    case BENCH_UNIFORM:
+        return w->min_size + (int) (bench_rand() %
+                (unsigned long) (w->max_size - w->min_size + 1));
+    case BENCH_ZIPF:
+        r = bench_rand() & 0x7fffffffUL;
+        lo = 0;
+        hi = BENCH_ZIPF_SIZES - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (zipf_cdf[mid] < r) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        return w->min_size * (lo + 1);
+    default:
+        return w->min_size;
+    }
+}
+
+static void *pool_malloc(void *ctx, int size)
+{
+    return mplite_malloc((mplite_t *) ctx, size);
+}
+
+static void pool_free(void *ctx, void *p)
+{
+    mplite_free((mplite_t *) ctx, p);
+}
+
+/* mplite_realloc takes sizes rounded up by mplite_roundup */
+static void *pool_realloc(void *ctx, void *p, int size)
+{
+    return mplite_realloc((mplite_t *) ctx, p,
+                          mplite_roundup((mplite_t *) ctx, size));
+}
+
+static void *sys_malloc(void *ctx, int size)
+{
+    (void) ctx;
+    return malloc(size);
+}
+
+static void sys_free(void *ctx, void *p)
+{
+    (void) ctx;
+    free(p);
+}
+
+static void *sys_realloc(void *ctx, void *p, int size)
+{
+    (void) ctx;
+    return realloc(p, size);
+}
+
+static int compare_ulong(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *) a;
+    unsigned long y = *(const unsigned long *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Run nOps operations of a workload. A round allocates every slot of the
+ * working set and then frees them all in the order of the workload. A
+ * realloc round grows each slot from the minimum to the maximum size instead
+ * of allocating it once. If lat is not NULL every operation is timed and its
+ * latency stored there. Return the number of operations done.
+ */
+static unsigned long run_workload(const bench_workload_t *w,
+                                  const bench_alloc_t *a, void **slots,
+                                  int *perm, const int nSlot,
+                                  const unsigned long nOps,
+                                  unsigned long *lat, unsigned long *fails)
+{
+    unsigned long nDone = 0;
+    unsigned long long t0 = 0;
+    int i;
+
+    while (nDone < nOps) {
+        for (i = 0; (i < nSlot) && (nDone < nOps); i++) {
+            int size = bench_size(w);
+
+            if (lat != NULL) {
+                t0 = bench_now();
+            }
+            slots[i] = a->malloc_fn(a->ctx, size);
+            if (lat != NULL) {
+                lat[nDone] = (unsigned long) (bench_now() - t0);
+            }
+            nDone++;
+            if (NULL == slots[i]) {
+                (*fails)++;
+                continue;
+            }
+            memset(slots[i], 0, 8);
+            while ((BENCH_REALLOC == w->mix) && (size < w->max_size) &&
+                   (nDone < nOps)) {
+                void *p;
+                size += size / 4;
+                if (size > w->max_size) {
+                    size = w->max_size;
+                }
+                if (lat != NULL) {
+                    t0 = bench_now();
+                }
+                p = a->realloc_fn(a->ctx, slots[i], size);
+                if (lat != NULL) {
+                    lat[nDone] = (unsigned long) (bench_now() - t0);
+                }
+                nDone++;
+                if (NULL == p) {
+                    (*fails)++;
+                    break;
+                }
+                slots[i] = p;
+            }
+        }
+        for (; i < nSlot; i++) {
+            slots[i] = NULL;
+        }
+
+        /* Free the whole working set in the workload's order */
+        for (i = 0; i < nSlot; i++) {
+            perm[i] = (BENCH_LIFO == w->order) ? nSlot - 1 - i : i;
+        }
+        if (BENCH_RANDOM == w->order) {
+            for (i = nSlot - 1; i > 0; i--) {
+                int j = (int) (bench_rand() % (unsigned long) (i + 1));
+                int t = perm[i];
+                perm[i] = perm[j];
+                perm[j] = t;
+            }
+        }
+        for (i = 0; i < nSlot; i++) {
+            void *p = slots[perm[i]];
+            if (NULL == p) {
+                continue;
+            }
+            if ((lat != NULL) && (nDone < nOps)) {
+                t0 = bench_now();
+                a->free_fn(a->ctx, p);
+                lat[nDone++] = (unsigned long) (bench_now() - t0);
+            }
+            else {
+                a->free_fn(a->ctx, p);
+                nDone++;
+            }
+        }
+    }
+    return nDone;
+}
+
+static void bench_one(const bench_workload_t *w, const bench_alloc_t *a,
+                      const int nSlot, const unsigned long nOps,
+                      void **slots, int *perm, unsigned long *lat,
+                      bench_result_t *r)
+{
+    unsigned long long t0;
+    unsigned long nDone;
+    unsigned long fails = 0;
+
+    memset(r, 0, sizeof (*r));
+
+    /* Throughput, with the same random sequence for every allocator */
+    rng_state = 88172645463325252ULL;
+    t0 = bench_now();
+    nDone = run_workload(w, a, slots, perm, nSlot, nOps, NULL, &fails);
+    r->ns_per_op = (double) (bench_now() - t0) / nDone;
+    r->fails = fails;
+
+    /* Latency */
+    rng_state = 88172645463325252ULL;
+    fails = 0;
+    nDone = run_workload(w, a, slots, perm, nSlot, nOps, lat, &fails);
+    if (nDone > nOps) {
+        nDone = nOps;
+    }
+    qsort(lat, nDone, sizeof (*lat), compare_ulong);
+    r->p50 = lat[nDone / 2];
+    r->p99 = lat[nDone * 99 / 100];
+    r->p999 = lat[nDone * 999 / 1000];
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long nOps = BENCH_OPS_DEFAULT;
+    unsigned long long t0;
+    unsigned long *lat;
+    void **slots;
+    int *perm;
+    char *pool_buf;
+    mplite_t pool;
+    bench_alloc_t allocs[2];
+    bench_result_t r;
+    size_t iPool;
+    size_t iMin;
+    size_t iWork;
+    int i;
+
+    if (argc > 1) {
+        nOps = strtoul(argv[1], NULL, 10);
+        if (nOps < 1000) {
+            nOps = 1000;
+        }
+    }
+
+    /* The operations past nOps of a round are not timed, so lat only needs
+     ** room for nOps entries.
+     */
+    lat = (unsigned long *) malloc(sizeof (*lat) * nOps);
+    slots = (void **) malloc(sizeof (*slots) * BENCH_SLOTS_MAX);
+    perm = (int *) malloc(sizeof (*perm) * BENCH_SLOTS_MAX);
+    pool_buf = (char *) malloc(pool_sizes[sizeof (pool_sizes) /
+                               sizeof (pool_sizes[0]) - 1]);
+    if ((NULL == lat) || (NULL == slots) || (NULL == perm) ||
+        (NULL == pool_buf)) {
+        printf("out of memory\n");
+        return 1;
+    }
+    zipf_setup();
+
+    allocs[0].name = "mplite";
+    allocs[0].malloc_fn = pool_malloc;
+    allocs[0].free_fn = pool_free;
+    allocs[0].realloc_fn = pool_realloc;
+    allocs[0].ctx = &pool;
+    allocs[1].name = "malloc";
+    allocs[1].malloc_fn = sys_malloc;
+    allocs[1].free_fn = sys_free;
+    allocs[1].realloc_fn = sys_realloc;
+    allocs[1].ctx = NULL;
+
+    t0 = bench_now();
+    for (i = 0; i < 1000; i++) {
+        bench_now();
+    }
+    printf("clock_overhead_ns=%.1f ops=%lu\n",
+           (double) (bench_now() - t0) / 1000, nOps);
+
+    for (iPool = 0; iPool < sizeof (pool_sizes) / sizeof (pool_sizes[0]);
+         iPool++) {
+        for (iMin = 0; iMin < sizeof (min_allocs) / sizeof (min_allocs[0]);
+             iMin++) {
+            for (iWork = 0; iWork < sizeof (workloads) / sizeof (workloads[0]);
+                 iWork++) {
+                const bench_workload_t *w = &workloads[iWork];
+                /* Keep the working set to an eighth of the pool */
+                int nSlot = pool_sizes[iPool] / 8 / w->max_size;
+                size_t iAlloc;
+
+                if (nSlot < BENCH_SLOTS_MIN) {
+                    nSlot = BENCH_SLOTS_MIN;
+                }
+                if (nSlot > BENCH_SLOTS_MAX) {
+                    nSlot = BENCH_SLOTS_MAX;
+                }
+                for (iAlloc = 0; iAlloc < 2; iAlloc++) {
+                    mplite_init(&pool, pool_buf, pool_sizes[iPool],
+                                min_allocs[iMin], NULL);
+                    bench_one(w, &allocs[iAlloc], nSlot, nOps, slots, perm,
+                              lat, &r);
+                    printf("pool=%d min_alloc=%d workload=%s slots=%d "
+                           "alloc=%s ns_per_op=%.1f p50=%lu p99=%lu "
+                           "p999=%lu fails=%lu\n", pool_sizes[iPool],
+                           min_allocs[iMin], w->name, nSlot,
+                           allocs[iAlloc].name, r.ns_per_op, r.p50, r.p99,
+                           r.p999, r.fails);
+                }
+            }
+        }
+    }
+
+    free(pool_buf);
+    free(perm);
+    free(slots);
+    free(lat);
+
+    return 0;
+}
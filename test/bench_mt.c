@@ -0,0 +1,339 @@
+/*
+ * Multithreaded scalability benchmark of a single mplite pool.
+ *
+ * The number of threads is swept in powers of two from 1 up to a maximum,
+ * for every lock the pool supports and for these scenarios:
+ *
+ *   churn     Every thread replaces random entries of its own working set.
+ *   prodcons  Threads are paired. One thread of a pair allocates and hands
+ *             the blocks over a ring to the other, which frees them.
+ *   burst     Every thread allocates a whole batch one block at a time and
+ *             then frees all of it.
+ *
+ * Each run reports the throughput, the mean time spent waiting for the pool
+ * lock per acquisition and the share of acquisitions that had to wait. The
+ * built-in locks are measured by the pool itself. For the mutex given as lock
+ * callbacks the benchmark wraps the mutex to measure the same.
+ *
+ * Usage: bench_mt [maximum threads [operations per thread]]
+ */
+#include "mplite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_OPS_DEFAULT    200000
+#define BENCH_POOL_SIZE      (64 << 20)
+#define BENCH_MIN_ALLOC      16
+#define BENCH_SLOTS          64
+#define BENCH_BURST          256
+#define BENCH_RING           1024
+
+typedef enum bench_scenario {
+    BENCH_CHURN,
+    BENCH_PRODCONS,
+    BENCH_BURST_FREE
+} bench_scenario_t;
+
+/* Single-producer single-consumer ring between the threads of a pair */
+typedef struct bench_ring {
+    void *apSlot[BENCH_RING];
+    volatile unsigned long iHead; /* Written by the producer */
+    char aPad[64];
+    volatile unsigned long iTail; /* Written by the consumer */
+} bench_ring_t;
+
+/* Mutex behind the lock callbacks, with its own contention counters */
+typedef struct bench_mutex {
+    pthread_mutex_t mutex;
+    unsigned long long nContended;
+    unsigned long long nWaitNs;
+} bench_mutex_t;
+
+typedef struct bench_thread {
+    pthread_t thread;
+    mplite_t *pool;
+    bench_scenario_t scenario;
+    bench_ring_t *ring; /* Ring of the pair in BENCH_PRODCONS */
+    int producer; /* True for the allocating thread of a pair */
+    unsigned long nOps;
+    unsigned long long seed;
+    unsigned long nDone;
+    unsigned long nFail;
+} bench_thread_t;
+
+static const char *scenario_names[] = {"churn", "prodcons", "burst"};
+static volatile int start_flag;
+
+static unsigned long long bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long bench_rand(unsigned long long *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (unsigned long) (*state >> 33);
+}
+
+static int bench_size(unsigned long long *state)
+{
+    return 16 + (int) (bench_rand(state) % 497);
+}
+
+static int bench_mutex_acquire(void *arg)
+{
+    bench_mutex_t *m = (bench_mutex_t *) arg;
+    unsigned long long t0;
+    int rc;
+
+    if (pthread_mutex_trylock(&m->mutex) == 0) {
+        return 0;
+    }
+    t0 = bench_now();
+    rc = pthread_mutex_lock(&m->mutex);
+    m->nContended++;
+    m->nWaitNs += bench_now() - t0;
+    return rc;
+}
+
+static int bench_mutex_release(void *arg)
+{
+    return pthread_mutex_unlock(&((bench_mutex_t *) arg)->mutex);
+}
+
+static void run_churn(bench_thread_t *t)
+{
+    void *apSlot[BENCH_SLOTS];
+    int i;
+
+    memset(apSlot, 0, sizeof (apSlot));
+    while (t->nDone < t->nOps) {
+        i = (int) (bench_rand(&t->seed) % BENCH_SLOTS);
+        if (apSlot[i] != NULL) {
+            mplite_free(t->pool, apSlot[i]);
+            apSlot[i] = NULL;
+        }
+        else {
+            apSlot[i] = mplite_malloc(t->pool, bench_size(&t->seed));
+            t->nFail += (NULL == apSlot[i]);
+        }
+        t->nDone++;
+    }
+    for (i = 0; i < BENCH_SLOTS; i++) {
+        if (apSlot[i] != NULL) {
+            mplite_free(t->pool, apSlot[i]);
+        }
+    }
+}
+
+static void run_burst(bench_thread_t *t)
+{
+    void *apSlot[BENCH_BURST];
+    int n;
+    int i;
+
+    while (t->nDone < t->nOps) {
+        for (n = 0; n < BENCH_BURST; n++) {
+            apSlot[n] = mplite_malloc(t->pool, bench_size(&t->seed));
+            t->nFail += (NULL == apSlot[n]);
+        }
+        for (i = 0; i < n; i++) {
+            if (apSlot[i] != NULL) {
+                mplite_free(t->pool, apSlot[i]);
+            }
+        }
+        t->nDone += 2 * BENCH_BURST;
+    }
+}
+
+/*
+ * The producer allocates nOps / 2 blocks and the consumer frees them, so
+ * each thread of a pair does half of the pair's operations.
+ */
+static void run_prodcons(bench_thread_t *t)
+{
+    bench_ring_t *r = t->ring;
+    unsigned long nBlock = t->nOps / 2;
+    unsigned long i;
+
+    for (i = 0; i < nBlock; i++) {
+        if (t->producer) {
+            void *p = mplite_malloc(t->pool, bench_size(&t->seed));
+            unsigned long iHead = r->iHead;
+            while (iHead - __atomic_load_n(&r->iTail, __ATOMIC_ACQUIRE) >=
+                   BENCH_RING) {
+                sched_yield();
+            }
+            t->nFail += (NULL == p);
+            r->apSlot[iHead % BENCH_RING] = p;
+            __atomic_store_n(&r->iHead, iHead + 1, __ATOMIC_RELEASE);
+        }
+        else {
+            unsigned long iTail = r->iTail;
+            while (__atomic_load_n(&r->iHead, __ATOMIC_ACQUIRE) == iTail) {
+                sched_yield();
+            }
+            if (r->apSlot[iTail % BENCH_RING] != NULL) {
+                mplite_free(t->pool, r->apSlot[iTail % BENCH_RING]);
+            }
+            __atomic_store_n(&r->iTail, iTail + 1, __ATOMIC_RELEASE);
+        }
+        t->nDone++;
+    }
+}
+
+static void *bench_thread_main(void *arg)
+{
+    bench_thread_t *t = (bench_thread_t *) arg;
+
+    while (!__atomic_load_n(&start_flag, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    switch (t->scenario) {
+    case BENCH_CHURN:
+        run_churn(t);
+        break;
+    case BENCH_PRODCONS:
+        run_prodcons(t);
+        break;
+    default:
+        run_burst(t);
+        break;
+    }
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const char *lock_names[] = {"mutex", "spin", "futex", "ticket"};
+    const mplite_lock_t *apLock[4];
+    unsigned long nOps = BENCH_OPS_DEFAULT;
+    int nMaxThread;
+    char *pool_buf;
+    mplite_t pool;
+    mplite_lock_t mutex_lock;
+    bench_mutex_t mutex;
+    bench_thread_t *threads;
+    bench_ring_t *rings;
+    int iLock;
+    int iScenario;
+    int nThread;
+    int i;
+
+    nMaxThread = (int) sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    if (argc > 1) {
+        nMaxThread = atoi(argv[1]);
+    }
+    if (nMaxThread < 1) {
+        nMaxThread = 1;
+    }
+    if (argc > 2) {
+        nOps = strtoul(argv[2], NULL, 10);
+    }
+    if (nOps < 2 * BENCH_BURST) {
+        nOps = 2 * BENCH_BURST;
+    }
+
+    pool_buf = (char *) malloc(BENCH_POOL_SIZE);
+    threads = (bench_thread_t *) calloc(nMaxThread, sizeof (*threads));
+    rings = (bench_ring_t *) calloc(nMaxThread, sizeof (*rings));
+    if ((NULL == pool_buf) || (NULL == threads) || (NULL == rings)) {
+        printf("out of memory\n");
+        return 1;
+    }
+
+    pthread_mutex_init(&mutex.mutex, NULL);
+    mutex_lock.arg = &mutex;
+    mutex_lock.acquire = bench_mutex_acquire;
+    mutex_lock.release = bench_mutex_release;
+    apLock[0] = &mutex_lock;
+    apLock[1] = MPLITE_LOCK_SPIN;
+    apLock[2] = MPLITE_LOCK_FUTEX;
+    apLock[3] = MPLITE_LOCK_TICKET;
+
+    printf("cpus=%ld ops_per_thread=%lu\n", sysconf(_SC_NPROCESSORS_ONLN),
+           nOps);
+    for (iScenario = 0; iScenario < 3; iScenario++) {
+        for (iLock = 0; iLock < 4; iLock++) {
+            for (nThread = 1; nThread <= nMaxThread;
+                 nThread = (nThread * 2 > nMaxThread && nThread < nMaxThread) ?
+                 nMaxThread : nThread * 2) {
+                mplite_stats_t stats;
+                unsigned long long t0;
+                unsigned long long nWaitNs;
+                unsigned long long nContended;
+                unsigned long long nAcquire;
+                unsigned long nDone = 0;
+                unsigned long nFail = 0;
+                double elapsed;
+
+                /* Pairs need an even number of threads */
+                if ((BENCH_PRODCONS == iScenario) && (nThread & 1)) {
+                    continue;
+                }
+
+                mutex.nContended = 0;
+                mutex.nWaitNs = 0;
+                memset(rings, 0, nMaxThread * sizeof (*rings));
+                mplite_init(&pool, pool_buf, BENCH_POOL_SIZE, BENCH_MIN_ALLOC,
+                            apLock[iLock]);
+                start_flag = 0;
+                for (i = 0; i < nThread; i++) {
+                    threads[i].pool = &pool;
+                    threads[i].scenario = (bench_scenario_t) iScenario;
+                    threads[i].ring = &rings[i / 2];
+                    threads[i].producer = ((i & 1) == 0);
+                    threads[i].nOps = nOps;
+                    threads[i].seed = 88172645463325252ULL + i;
+                    threads[i].nDone = 0;
+                    threads[i].nFail = 0;
+                    pthread_create(&threads[i].thread, NULL,
+                                   bench_thread_main, &threads[i]);
+                }
+                t0 = bench_now();
+                __atomic_store_n(&start_flag, 1, __ATOMIC_RELEASE);
+                for (i = 0; i < nThread; i++) {
+                    pthread_join(threads[i].thread, NULL);
+                    nDone += threads[i].nDone;
+                    nFail += threads[i].nFail;
+                }
+                elapsed = (double) (bench_now() - t0);
+
+                mplite_get_stats(&pool, &stats);
+                nWaitNs = stats.nLockWaitNs;
+                nContended = stats.nLockContended;
+                if (0 == iLock) {
+                    nWaitNs = mutex.nWaitNs;
+                    nContended = mutex.nContended;
+                }
+                nAcquire = (stats.nLockAcquire > 0) ? stats.nLockAcquire : 1;
+                printf("scenario=%s lock=%s threads=%d mops=%.2f "
+                       "wait_ns_per_acquire=%.1f contention=%.4f fails=%lu "
+                       "leaked=%llu\n", scenario_names[iScenario],
+                       lock_names[iLock], nThread, nDone * 1000.0 / elapsed,
+                       (double) nWaitNs / nAcquire,
+                       (double) nContended / nAcquire, nFail,
+                       (unsigned long long) stats.currentCount);
+            }
+        }
+    }
+
+    pthread_mutex_destroy(&mutex.mutex);
+    free(rings);
+    free(threads);
+    free(pool_buf);
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Replay an allocation trace written by mplite_trace_save against a fresh
+ * pool and report the time taken, the peak checkout and the failures.
+ *
+ * Usage: replay trace-file [pool size [minimum allocation size]]
+ *
+ * The pool size and minimum allocation size default to those of the recorded
+ * pool, in which case the replayed pool has exactly as many blocks as the
+ * recorded one and every allocation lands where it did when recorded.
+ * Operations are replayed back to back in recorded order, ignoring the
+ * time stamps, so the same trace and pool geometry always give the same
+ * placement and failures.
+ */
+#include "mplite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif /* #ifdef _WIN32 */
+
+/* Clock in nanoseconds */
+static unsigned long long replay_now(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (0 == freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (unsigned long long) (now.QuadPart * 1000000000.0 / freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif /* #ifdef _WIN32 */
+}
+
+int
+main(int argc, char **argv)
+{
+    mplite_trace_header_t hdr;
+    mplite_trace_rec_t *aRec;
+    mplite_stats_t stats;
+    mplite_t pool;
+    FILE *pIn;
+    void **apLive; /* Replayed allocation of each recorded id */
+    char *pool_buf;
+    long long pool_size;
+    int min_alloc;
+    unsigned long long t0;
+    unsigned long long elapsed;
+    unsigned long nFail = 0; /* Succeeded when recorded, failed in replay */
+    unsigned long nUnknown = 0; /* Refer to an id the replay does not hold */
+    unsigned long nMoved = 0; /* Placed elsewhere than when recorded */
+    uint64_t ii;
+
+    if (argc < 2) {
+        printf("usage: %s trace-file [pool-size [min-alloc]]\n", argv[0]);
+        return 1;
+    }
+
+    /* Load the whole trace so that reading it is not timed */
+    pIn = fopen(argv[1], "rb");
+    if ((NULL == pIn) || (fread(&hdr, sizeof (hdr), 1, pIn) != 1) ||
+        (hdr.magic != MPLITE_TRACE_MAGIC) ||
+        (hdr.version != MPLITE_TRACE_VERSION) ||
+        (hdr.szRec != sizeof (mplite_trace_rec_t))) {
+        printf("%s: not a trace file of this build\n", argv[1]);
+        return 1;
+    }
+    aRec = (mplite_trace_rec_t *) malloc((size_t) (hdr.nRec + 1) *
+                                         sizeof (*aRec));
+    apLive = (void **) calloc((size_t) hdr.nBlock, sizeof (*apLive));
+    if ((NULL == aRec) || (NULL == apLive) ||
+        (fread(aRec, sizeof (*aRec), (size_t) hdr.nRec, pIn) !=
+         (size_t) hdr.nRec)) {
+        printf("%s: truncated trace\n", argv[1]);
+        return 1;
+    }
+    fclose(pIn);
+
+    /* The buffer also holds the bookkeeping of the pool and its alignment
+     ** padding, so search for the smallest buffer that gives the recorded
+     ** number of blocks.
+     */
+    pool_size = (long long) (hdr.nBlock * hdr.szAtom * 2 +
+                             2 * MPLITE_POOL_ALIGN);
+    min_alloc = (int) hdr.szAtom;
+    if (argc > 2) {
+        pool_size = atoll(argv[2]);
+    }
+    if (argc > 3) {
+        min_alloc = atoi(argv[3]);
+    }
+    pool_buf = (char *) malloc((size_t) pool_size);
+    if (NULL == pool_buf) {
+        printf("cannot allocate %lld bytes\n", pool_size);
+        return 1;
+    }
+    if (argc <= 2) {
+        long long lo = (long long) (hdr.nBlock * hdr.szAtom);
+        long long hi = pool_size;
+        while (lo < hi) {
+            long long mid = lo + (hi - lo) / 2;
+            if ((mplite_init(&pool, pool_buf, (mplite_int_t) mid, min_alloc,
+                             NULL) == MPLITE_OK) &&
+                ((uint64_t) pool.nBlock >= hdr.nBlock)) {
+                hi = mid;
+            }
+            else {
+                lo = mid + 1;
+            }
+        }
+        pool_size = lo;
+    }
+    if (mplite_init(&pool, pool_buf, (mplite_int_t) pool_size, min_alloc,
+                    NULL) != MPLITE_OK) {
+        printf("cannot set up a pool of %lld bytes\n", pool_size);
+        return 1;
+    }
+
+    t0 = replay_now();
+    for (ii = 0; ii < hdr.nRec; ii++) {
+        const mplite_trace_rec_t *pRec = &aRec[ii];
+        void *pOld = NULL;
+        void *p;
+
+        if (pRec->iId != MPLITE_TRACE_NONE) {
+            pOld = (pRec->iId < hdr.nBlock) ? apLive[pRec->iId] : NULL;
+            if (NULL == pOld) {
+                nUnknown++;
+                if (0 == pRec->nSize) {
+                    continue;
+                }
+            }
+        }
+
+        if (0 == pRec->nSize) {
+            mplite_free(&pool, pOld);
+            apLive[pRec->iId] = NULL;
+            continue;
+        }
+
+        if (pOld != NULL) {
+            p = mplite_realloc(&pool, pOld,
+                               mplite_roundup(&pool,
+                                              (mplite_int_t) pRec->nSize));
+        }
+        else {
+            p = mplite_malloc(&pool, (mplite_int_t) pRec->nSize);
+        }
+        if (NULL == p) {
+            nFail += (pRec->iNewId != MPLITE_TRACE_NONE);
+            continue;
+        }
+        if (pOld != NULL) {
+            apLive[pRec->iId] = NULL;
+        }
+        if (pRec->iNewId < hdr.nBlock) {
+            nMoved += ((uint64_t) (mplite_offset(&pool, p) / pool.szAtom) !=
+                       pRec->iNewId);
+            apLive[pRec->iNewId] = p;
+        }
+        else if (pOld != NULL) {
+            /* A realloc that failed when recorded left the caller holding
+             ** the old allocation under the old id.
+             */
+            apLive[pRec->iId] = p;
+        }
+        else {
+            /* A malloc that failed when recorded handed nothing out */
+            mplite_free(&pool, p);
+        }
+    }
+    elapsed = replay_now() - t0;
+
+    mplite_get_stats(&pool, &stats);
+    printf("records=%llu lost=%llu recorded_ns=%llu replay_ns=%llu "
+           "ns_per_op=%.1f\n", (unsigned long long) hdr.nRec,
+           (unsigned long long) hdr.nLost,
+           (unsigned long long) ((hdr.nRec > 0) ? aRec[hdr.nRec - 1].iTime :
+                                 0), elapsed,
+           (hdr.nRec > 0) ? (double) elapsed / hdr.nRec : 0.0);
+    printf("pool=%lld min_alloc=%d peak_out=%llu peak_count=%llu "
+           "out_at_end=%llu failures=%lu replay_failures=%llu "
+           "unknown_ids=%lu moved=%lu\n", pool_size, min_alloc,
+           (unsigned long long) stats.maxOut,
+           (unsigned long long) stats.maxCount,
+           (unsigned long long) stats.currentOut, nFail,
+           (unsigned long long) stats.nFail, nUnknown, nMoved);
+
+    free(pool_buf);
+    free(apLive);
+    free(aRec);
+
+    return 0;
+}